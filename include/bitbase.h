@@ -0,0 +1,11 @@
+#ifndef BITBASE_H // include guard
+#define BITBASE_H
+
+#include "board.h"
+#include "types.h"
+
+void init_kpk();
+double kpk_generation_time();
+bool kpk_probe(Board *board);
+
+#endif  // BITBASE_H
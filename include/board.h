@@ -3,23 +3,49 @@
 
 #include "types.h"
 
-#define MAX_NUM_MOVES 17_697
+#define MAX_NUM_MOVES 17697 // plies in the longest possible game (75-move rule)
 #define MAX_NUM_LEGAL_MOVES 218
+#define MAX_SEARCH_PLY 512
+#define STACK_CAPACITY (MAX_NUM_MOVES + MAX_SEARCH_PLY)
+#define CACHE_LINE 64
+#define HALF_MOVE_MASK 0x1ffff
+#define CASTLING_MASK  0x78000000
 
+// irreversible state & zobrist hash of a single ply, kept together so that
+// make_move reads & writes a single cache line per ply
+typedef struct {
+    U64 hash;
+    StateFlags state;
+    int psq; // packed mg/eg material + piece-square balance, positive for white
+} History;
+
+/*
+ * The history stack is stored inline, so a board is one contiguous allocation
+ * that make_move never has to grow and whose used part can be copied with a
+ * single memcpy.
+ */
 typedef struct {
     U64 colors[NUM_COLORS];
     U64 pieces[NUM_PIECES];
+    U8  squares[NUM_SQUARES]; // piece index on each square, kept in sync with pieces
     int ply;
-    bool side_to_move;
-    int stack_capacity;
     int ply_offset;
-    StateFlags *state_stack;
-    U64 *hash_stack;
+    U64 pawn_key;     // zobrist key of the pawns alone, indexes the pawn table
+    U64 material_key; // zobrist key of the piece counts, indexes the material table
+    bool side_to_move;
+    struct Accumulator *acc;       // top of the NNUE accumulator stack, NULL if unused
+    struct Accumulator *acc_stack; // owned by this board, see nnue_attach
+    _Alignas(CACHE_LINE) History history[STACK_CAPACITY];
 } Board;
 
 void make_move(Board *board, Move move);
 void unmake_move(Board *board, Move move);
-Move* legal_moves(Board *board, Move *list);
+ScoredMove* legal_moves(Board *board, ScoredMove *list);
+ScoredMove* capture_moves(Board *board, ScoredMove *list);
+ScoredMove* quiet_moves(Board *board, ScoredMove *list);
+ScoredMove* evasion_moves(Board *board, ScoredMove *list);
+bool is_legal(Board *board, Move move);
+int count_legal_moves(Board *board);
 bool is_in_check(Board *board);
 bool is_threefold(Board *board);
 U64 get_hash(Board *board);
@@ -27,6 +53,7 @@ Move random_move(Board *board);
 Move move_from_str(Board *board, char* str);
 U64 perft(Board *board, int depth);
 void print_perft(Board *board, int depth);
+Board* new_board();
 Board* from_fen(char *fen);
 char* to_fen(Board *board);
 void free_board(Board *board);
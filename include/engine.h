@@ -4,6 +4,9 @@
 #include "types.h"
 
 #define DEFAULT_TT_SIZE 256
+#define DEFAULT_THREADS 1
+#define MAX_THREADS 256
+#define MAX_SEARCH_DEPTH 99
 
 typedef struct {
     int infinite;
@@ -18,7 +21,7 @@ typedef struct {
 
 static const SearchParams PARAMS_DEFAULT = (SearchParams){
     .infinite = 0,
-    .depth = 99,
+    .depth = MAX_SEARCH_DEPTH,
     .wtime = 0,
     .btime = 0,
     .winc = 0,
@@ -31,11 +34,20 @@ void engine_set_debug(bool mode);
 bool engine_is_debug();
 void engine_move(char* move_str);
 void engine_unmove();
+void engine_new_game();
 void engine_quit();
+void set_engine_threads(int num_threads);
+bool set_engine_eval_file(char* path);
+bool set_engine_syzygy_path(char* path);
 void resize_engine_table(int mb_size);
+bool save_engine_table(char* path);
+bool load_engine_table(char* path);
 int set_position(char* fen, char** moves);
 void print_engine();
 void go_perft(int depth);
+void bench_perft();
+void bench_search();
+void bench_eval();
 void go_random();
 void start_search(SearchParams params);
 int stop_search();
@@ -1,7 +1,10 @@
 #ifndef EVAL_H // include guard
 #define EVAL_H
 
+#include <stdatomic.h>
+#include <time.h>
 #include "board.h"
+#include "table.h"
 
 #define PAWN_CP   100
 #define KNIGHT_CP 300
@@ -13,8 +16,74 @@
 
 #define CHECKMATE_CP (2 << 15)
 
+typedef struct {
+    struct timespec start;
+    int movetime; // milliseconds, 0 if unlimited
+} SearchLimits;
+
+/*
+ * Per-thread search state. Every search thread owns its board copy, counters
+ * and move ordering tables. Only the stop flag and the transposition table
+ * are shared between threads. Contexts are cache line aligned so the node
+ * counters of neighbouring threads never share a line.
+ *
+ * killers     two quiet moves per ply that last caused a beta cutoff
+ * history     cutoff scores of quiet moves by [side][from][to]
+ * root_moves  moves searched at the root, all of them if num_root_moves is 0
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) Board *board;
+    U64 nodes;
+    U64 tbhits;
+    U8 seldepth;
+    SearchLimits limits;
+    atomic_bool *stop;
+    const Move *root_moves;
+    int num_root_moves;
+    Move killers[MAX_SEARCH_PLY][2];
+    int history[NUM_COLORS][NUM_SQUARES][NUM_SQUARES];
+} SearchContext;
+
+void init_search_context(SearchContext *ctx, Board *board, SearchLimits limits, atomic_bool *stop);
+#define MAX_PHASE 24
+
+// specialised endgame evaluators, chosen by the material table
+#define ENDGAME_NONE 0
+#define ENDGAME_DRAW 1 // insufficient mating material
+#define ENDGAME_KXK  2 // mating material against a bare king
+#define ENDGAME_KBNK 3
+#define ENDGAME_OCB  4 // opposite coloured bishops, scales the score down
+#define ENDGAME_KPK  5 // probes the KPK bitbase
+#define NUM_ENDGAMES 6
+
+/*
+ * Middlegame and endgame values packed into one int, so a single add updates
+ * both. The endgame half is rounded so negative middlegame halves borrow
+ * correctly.
+ */
+#define MAKE_SCORE(mg, eg) ((int)((unsigned)(eg) << 16) + (mg))
+
+static inline int mg_value(int score) {
+    return (int16_t)(unsigned)score;
+}
+
+static inline int eg_value(int score) {
+    return (int16_t)((unsigned)(score + 0x8000) >> 16);
+}
+
+// packed material + piece-square value of a piece, positive for white
+extern int PSQ[NUM_PIECES][NUM_COLORS][NUM_SQUARES];
+// game phase contributed by each piece, MAX_PHASE with all pieces on board
+extern const int PHASE_WEIGHTS[NUM_PIECES];
+
+void init_psq();
+int board_psq(Board *board);
+int board_phase(Board *board);
+void material_eval(Board *board, MaterialEntry *entry);
+int pawn_eval(Board *board);
+int search_root(SearchContext *ctx, U8 depth);
 U64 eval(Board *board, U8 depth);
+int evaluate(Board *board);
 int piece_eval(Board *board);
-void start_timer();
 
 #endif // EVAL_H
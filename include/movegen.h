@@ -3,13 +3,76 @@
 
 #include "types.h"
 
+// slider attack backends
+#define SLIDER_MAGIC 0 // portable multiply-shift magic indexing
+#define SLIDER_PEXT  1 // BMI2 pext indexing, x86-64 only
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAS_PEXT_BACKEND 1
+
+// Written as inline assembly rather than _pext_u64 so it inlines into callers
+// built without -mbmi2. Only reached once best_slider_backend found BMI2.
+static inline U64 pext(U64 src, U64 mask) {
+    U64 dst;
+    __asm__("pextq %2, %1, %0" : "=r" (dst) : "r" (src), "rm" (mask));
+    return dst;
+}
+#endif
+
+/*
+ * Fancy magic bitboard entry for a single square. The attack set for an
+ * occupancy is found at attacks[((occ & mask) * magic) >> shift], or at
+ * attacks[pext(occ, mask)] with the pext backend.
+ * https://www.chessprogramming.org/Magic_Bitboards
+ */
+typedef struct {
+    U64  mask;
+    U64  magic;
+    U64 *attacks;
+    int  shift;
+} Magic;
+
+extern Magic ROOK_MAGICS[NUM_SQUARES];
+extern Magic BISHOP_MAGICS[NUM_SQUARES];
+extern int SLIDER_BACKEND;
+
+// squares strictly between two aligned squares, empty if not aligned
+extern U64 BETWEEN[NUM_SQUARES][NUM_SQUARES];
+// the full rank, file or diagonal through two aligned squares, empty if not aligned
+extern U64 LINE[NUM_SQUARES][NUM_SQUARES];
+
 void init_move_lookup_tables();
+int best_slider_backend();
+int set_slider_backend(int backend);
+const char* slider_backend_name();
 U64 n_moves(U64 orig);
 U64 k_moves(U64 orig);
-U64 r_moves(U64 orig, U64 blocks);
-U64 b_moves(U64 orig, U64 blocks);
 //U64 h_moves(U64 orig, U64 blocks);
 U64 v_moves(U64 orig, U64 blocks);
-U64 q_moves(U64 orig, U64 blocks);
+
+// Picks the attack set index of a slider. The backend never changes during a
+// search, so the branch is always predicted and, unlike a call through a
+// function pointer, keeps the lookup inlined into move generation.
+static inline U64 slider_index(const Magic *m, U64 blocks) {
+#ifdef HAS_PEXT_BACKEND
+    if (SLIDER_BACKEND == SLIDER_PEXT)
+        return pext(blocks, m->mask);
+#endif
+    return ((blocks & m->mask) * m->magic) >> m->shift;
+}
+
+static inline U64 r_moves(U64 orig, U64 blocks) {
+    const Magic *m = &ROOK_MAGICS[__builtin_ctzll(orig)];
+    return m->attacks[slider_index(m, blocks)];
+}
+
+static inline U64 b_moves(U64 orig, U64 blocks) {
+    const Magic *m = &BISHOP_MAGICS[__builtin_ctzll(orig)];
+    return m->attacks[slider_index(m, blocks)];
+}
+
+static inline U64 q_moves(U64 orig, U64 blocks) {
+    return r_moves(orig, blocks) | b_moves(orig, blocks);
+}
 
 #endif  // MOVEGEN_H
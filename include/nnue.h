@@ -0,0 +1,39 @@
+#ifndef NNUE_H // include guard
+#define NNUE_H
+
+#include "board.h"
+#include "types.h"
+
+// inference backends
+#define NNUE_SCALAR 0 // portable C
+#define NNUE_AVX2   1 // 256-bit integer SIMD, x86-64 only
+
+#define NNUE_INPUTS 768 // colour (relative to perspective) x piece x square
+#define NNUE_HIDDEN 256
+#define NNUE_QA     255 // accumulator quantisation, also the clipped ReLU ceiling
+#define NNUE_QB     64  // output weight quantisation
+#define NNUE_SCALE  400 // network output to centipawns
+
+/*
+ * First layer output of both perspectives for one ply. make_move fills the
+ * accumulator of the next ply from the current one by adding & subtracting
+ * the weights of the pieces that moved, unmake_move only pops the stack.
+ */
+typedef struct Accumulator {
+    _Alignas(32) int16_t values[NUM_COLORS][NNUE_HIDDEN];
+} Accumulator;
+
+bool nnue_load(const char *path);
+void nnue_init_random(U64 seed);
+void nnue_unload();
+bool nnue_enabled();
+int best_nnue_backend();
+int set_nnue_backend(int backend);
+const char* nnue_backend_name();
+void nnue_attach(Board *board);
+void nnue_detach(Board *board);
+void nnue_refresh(Board *board, Accumulator *acc);
+void nnue_push(Board *board, Move move);
+int nnue_evaluate(Board *board);
+
+#endif  // NNUE_H
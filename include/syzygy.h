@@ -0,0 +1,30 @@
+#ifndef SYZYGY_H // include guard
+#define SYZYGY_H
+
+#include "board.h"
+#include "types.h"
+
+#define TB_PIECES 6 // largest tables looked for, kings included
+
+// win/draw/loss from the side to move, cursed wins & blessed losses are
+// decided by the 50-move rule
+#define TB_LOSS         -2
+#define TB_BLESSED_LOSS -1
+#define TB_DRAW          0
+#define TB_CURSED_WIN    1
+#define TB_WIN           2
+
+#define TB_WIN_CP 20000 // score of a tablebase win, above any known endgame win
+
+// most pieces of any table found, 0 if tablebases are off
+extern int TB_LARGEST;
+
+bool tb_init(const char *paths);
+void tb_free();
+bool tb_covers(Board *board);
+int tb_num_tables();
+bool tb_probe_wdl(Board *board, int *wdl);
+bool tb_probe_dtz(Board *board, int *dtz);
+int tb_root_moves(Board *board, Move *moves);
+
+#endif  // SYZYGY_H
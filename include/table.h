@@ -4,32 +4,133 @@
 #include "board.h"
 #include "types.h"
 
+#ifndef TT_PREFETCH
+#define TT_PREFETCH 1
+#endif
+
 #define EMPTY_NODE '\0'
 #define EXACT_NODE 'e'
 #define MATE_NODE 'm'
 #define ALL_NODE 'a' // fail-low node. Lower bound - possibly less than this number. Alpha. At most this number.
 #define CUT_NODE 'b' // fail-high node. Upper bound - possibly greater than this number. Beta. At least this number.
 
+// transposition table entry as seen by the search, unpacked by tt_probe
 typedef struct {
-    U64  key;
-    char type;
-    U8   depth;
     int  score;
     Move best;
+    char type;
+    U8   depth;
 } TTEntry;
 
+/*
+ * Entry as stored in the table. The index of a bucket comes from the high bits
+ * of the hash, so only the low 16 bits are kept to tell positions apart within
+ * a bucket. Mate scores are shifted down to fit in 16 bits.
+ *
+ * An entry is exactly one word, which is always loaded and stored with a
+ * single atomic operation. Threads sharing the table can therefore never see
+ * a half written entry, and no locks are needed.
+ *
+ * bound_age  search generation << 2 | bound (0 if the slot is empty)
+ */
+typedef union {
+    struct {
+        U16     key;
+        Move    best;
+        int16_t score;
+        U8      depth;
+        U8      bound_age;
+    };
+    U64 raw;
+} PackedTTEntry;
+
+#define TT_BUCKET_SIZE (CACHE_LINE / sizeof(PackedTTEntry))
+
+// entries sharing a single cache line
+typedef struct {
+    _Alignas(CACHE_LINE) PackedTTEntry entries[TT_BUCKET_SIZE];
+} TTBucket;
+
+/*
+ * Perft hash entry, shared between perft threads without locking. The key is
+ * stored XORed with the data so a torn write fails verification instead of
+ * returning a wrong count.
+ *
+ * data    nodes << 8 | depth
+ */
+typedef struct {
+    U64 key;
+    U64 data;
+} PerftEntry;
+
+/*
+ * Pawn structure entry, shared between search threads the same way as
+ * PerftEntry. The pawn table is small and fixed in size, pawn structures
+ * repeat so often that it rarely misses.
+ *
+ * data    packed mg/eg pawn structure score, positive for white
+ */
+typedef struct {
+    U64 key;
+    U64 data;
+} PawnEntry;
+
+// material table entry as seen by the evaluation, unpacked by material_tt_probe
+typedef struct {
+    int  imbalance; // packed mg/eg score, positive for white
+    U8   phase;     // capped at MAX_PHASE
+    U8   endgame;   // specialised evaluator, see ENDGAMES in eval.c
+    bool strong;    // side the evaluator is applied for
+} MaterialEntry;
+
 // Zobrist hashes
 extern U64 ZOBRIST_PIECE_SQ[NUM_PIECES][NUM_COLORS][NUM_SQUARES];
 extern U64 ZOBRIST_BLACK;
 // 1111 -> KQkq
 extern U64 ZOBRIST_CASTLING[16];
 extern U64 ZOBRIST_EP[8];
+// the nth piece of a kind on the board adds ZOBRIST_MATERIAL[piece][color][n - 1]
+extern U64 ZOBRIST_MATERIAL[NUM_PIECES][NUM_COLORS][16];
+
+// shared transposition table, inlined lookups below read it directly
+extern TTBucket* T_TABLE;
+extern U64 TT_BUCKETS;
+
+// maps the high bits of the key onto [0, TT_BUCKETS) without a division
+static inline TTBucket* tt_bucket(U64 key) {
+    return &T_TABLE[((unsigned __int128)key * TT_BUCKETS) >> 64];
+}
+
+// Starts loading the bucket of a position that is about to be probed, so the
+// cache miss overlaps with the work done before the probe. Inline so interior
+// nodes do not pay a call for it.
+static inline void tt_prefetch(U64 key) {
+    if (TT_BUCKETS)
+        __builtin_prefetch(tt_bucket(key));
+}
 
 void init_zobrist();
 void tt_set_size(int mb_size);
-TTEntry* tt_probe(U64 key);
+void tt_clear();
+void tt_new_search();
+bool tt_save_file(char* path);
+int tt_load_file(char* path);
+bool tt_probe(U64 key, TTEntry* entry);
 void tt_save(U64 key, U8 depth, int score, Move best, char type);
+void perft_tt_set_size(int mb_size);
+bool perft_tt_probe(U64 key, int depth, U64 *nodes);
+void perft_tt_save(U64 key, int depth, U64 nodes);
+bool pawn_tt_probe(U64 key, int *score);
+void pawn_tt_save(U64 key, int score);
+void pawn_tt_clear();
+void pawn_tt_reset_stats();
+double pawn_tt_hit_rate();
+bool material_tt_probe(U64 key, MaterialEntry *entry);
+void material_tt_save(U64 key, MaterialEntry *entry);
+void material_tt_clear();
 U64 board_hash(Board* board);
+U64 pawn_hash(Board* board);
+U64 material_hash(Board* board);
 int mate_depth(int score);
 int mate_score(int score);
 void print_tt(TTEntry* entry);
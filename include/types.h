@@ -20,14 +20,17 @@
 #define ROOK_IDX     3
 #define QUEEN_IDX    4
 #define KING_IDX     5
+#define EMPTY_IDX    6 // mailbox value of an empty square
 
 #define UNIVERSE 0xffffffffffffffffULL 
 #define A_FILE   0x0101010101010101ULL 
 #define H_FILE   0x8080808080808080ULL 
 #define RANK_1   0x00000000000000ffULL
 #define RANK_2   0x000000000000ff00ULL
+#define RANK_3   0x0000000000ff0000ULL
 #define RANK_4   0x00000000ff000000ULL
 #define RANK_5   0x000000ff00000000ULL
+#define RANK_6   0x0000ff0000000000ULL
 #define RANK_7   0x00ff000000000000ULL
 #define RANK_8   0xff00000000000000ULL
 
@@ -62,6 +65,8 @@ enum enumSquare {
 };
 
 typedef uint64_t U64;
+typedef uint32_t U32;
+typedef uint16_t U16;
 typedef uint8_t  U8;
 typedef uint_fast8_t Sq;
 /*
@@ -73,7 +78,16 @@ typedef uint_fast8_t Sq;
  *             v-----v  to
  * 0000 0000 0000 0000
  */
-typedef uint_fast16_t Move;
+typedef uint16_t Move;
+/*
+ * A move paired with its ordering score, as written by the move generators.
+ * The score is left unset by the generators and filled in by whoever orders
+ * the moves.
+ */
+typedef struct {
+    Move move;
+    int16_t score;
+} ScoredMove;
 /*
  * A flag determining metadata for a single move
  * https://www.chessprogramming.org/Encoding_Moves
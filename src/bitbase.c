@@ -0,0 +1,214 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bitbase.h"
+#include "movegen.h"
+#include "utils.h"
+
+// white to move or not, both kings, pawn on files a-d & ranks 2-7
+#define KPK_POSITIONS (2 * NUM_SQUARES * NUM_SQUARES * 24)
+#define KPK_SQUARE_POSITIONS (2 * NUM_SQUARES * NUM_SQUARES) // one pawn square
+#define MAX_KPK_THREADS 4 // one per pawn file
+
+// retrograde results, a position can be several while its moves are combined
+#define KPK_INVALID 0
+#define KPK_UNKNOWN 1
+#define KPK_DRAW    2
+#define KPK_WIN     4
+
+// bit set if white wins, 24 KB
+static U32 KPK_BITBASE[KPK_POSITIONS / 32];
+static double KPK_GENERATION_MS = 0;
+
+typedef struct {
+    U8 *results;
+    int first_file;
+    int file_step;
+} KPKJob;
+
+/*
+ * Position index with white as the side with the pawn, which is mirrored onto
+ * files a-d.
+ *
+ * bits  0-5   white king square
+ * bits  6-11  black king square
+ * bit   12    black to move
+ * bits 13-14  pawn file
+ * bits 15-17  6 - pawn rank (0 on the 7th rank)
+ */
+static inline int kpk_index(bool stm, Sq bksq, Sq wksq, Sq psq) {
+    return wksq | (bksq << 6) | (stm << 12) | ((psq % 8) << 13) | ((6 - psq / 8) << 15);
+}
+
+static inline int distance(Sq a, Sq b) {
+    return MAX(abs(a % 8 - b % 8), abs(a / 8 - b / 8));
+}
+
+static inline U64 pawn_attacks(Sq psq) {
+    U64 bb = 1ULL << psq;
+    return nort_one(east_one(bb) | west_one(bb));
+}
+
+// result of a position from its own rules, before any move is looked at
+static U8 kpk_initial(int idx) {
+    Sq wksq = idx & 0x3f, bksq = (idx >> 6) & 0x3f;
+    bool stm = (idx >> 12) & 1;
+    Sq psq = ((idx >> 13) & 0x3) + 8 * (6 - (idx >> 15));
+    U64 wk_attacks = k_moves(1ULL << wksq);
+    U64 bk_attacks = k_moves(1ULL << bksq);
+
+    if (distance(wksq, bksq) <= 1 || wksq == psq || bksq == psq
+            || (stm == WHITE && (pawn_attacks(psq) & (1ULL << bksq))))
+        return KPK_INVALID;
+
+    // the pawn promotes without being taken
+    if (stm == WHITE && psq / 8 == 6 && wksq != psq + 8
+            && (distance(bksq, psq + 8) > 1 || distance(wksq, psq + 8) == 1))
+        return KPK_WIN;
+
+    // stalemate, or the pawn is taken
+    if (stm == BLACK && (!(bk_attacks & ~(wk_attacks | pawn_attacks(psq)))
+            || (bk_attacks & ~wk_attacks & (1ULL << psq))))
+        return KPK_DRAW;
+
+    return KPK_UNKNOWN;
+}
+
+/*
+ * White wins if any move wins, black draws if any move draws. Moves stay on the
+ * pawn's file, so no other thread writes the results read here.
+ */
+static U8 kpk_classify(U8 *results, int idx) {
+    Sq wksq = idx & 0x3f, bksq = (idx >> 6) & 0x3f;
+    bool stm = (idx >> 12) & 1;
+    Sq psq = ((idx >> 13) & 0x3) + 8 * (6 - (idx >> 15));
+    U8 good = stm == WHITE ? KPK_WIN : KPK_DRAW;
+    U8 bad = stm == WHITE ? KPK_DRAW : KPK_WIN;
+    U8 r = KPK_INVALID;
+    U64 aux1 = k_moves(1ULL << (stm == WHITE ? wksq : bksq));
+
+    while (aux1) {
+        Sq to = LOG2(pop_lsb(&aux1));
+        r |= results[stm == WHITE ? kpk_index(BLACK, bksq, to, psq) : kpk_index(WHITE, to, wksq, psq)];
+    }
+
+    if (stm == WHITE) {
+        if (psq / 8 < 6) // pushes onto the 8th rank were settled by kpk_initial
+            r |= results[kpk_index(BLACK, bksq, wksq, psq + 8)];
+        if (psq / 8 == 1 && psq + 8 != wksq && psq + 8 != bksq)
+            r |= results[kpk_index(BLACK, bksq, wksq, psq + 16)];
+    }
+
+    return r & good ? good : r & KPK_UNKNOWN ? KPK_UNKNOWN : bad;
+}
+
+/*
+ * Settles every pawn square of a thread's files, from the 7th rank down. A
+ * square only depends on itself and the squares its pawn is pushed to, so
+ * each one is swept until it stops changing and never looked at again. What
+ * is still unknown then is a draw.
+ */
+static void* kpk_worker(void *arg) {
+    KPKJob *job = (KPKJob*)arg;
+    int unknown[KPK_SQUARE_POSITIONS];
+    int file, rank, i, n, left, begin;
+    U8 r;
+
+    for (file = job->first_file; file < 4; file += job->file_step) {
+        for (rank = 6; rank >= 1; rank--) {
+            begin = kpk_index(WHITE, 0, 0, rank * 8 + file);
+            for (i = begin, n = 0; i < begin + KPK_SQUARE_POSITIONS; i++) {
+                if (job->results[i] == KPK_UNKNOWN)
+                    unknown[n++] = i;
+            }
+
+            // each pass only visits what the last one left undecided
+            left = n;
+            do {
+                n = left;
+                for (i = 0, left = 0; i < n; i++) {
+                    r = kpk_classify(job->results, unknown[i]);
+                    if (r == KPK_UNKNOWN)
+                        unknown[left++] = unknown[i];
+                    else
+                        job->results[unknown[i]] = r;
+                }
+            } while (left && left < n);
+        }
+    }
+
+    return NULL;
+}
+
+// Retrograde analysis of every KPK position, the pawn files split between
+// threads. Needs the king move tables.
+void init_kpk() {
+    pthread_t threads[MAX_KPK_THREADS];
+    KPKJob jobs[MAX_KPK_THREADS];
+    struct timespec start, end;
+    U8 *results = malloc(KPK_POSITIONS);
+    int i, num_threads = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), MAX_KPK_THREADS);
+
+    if (results == NULL) {
+        fprintf(stderr, "Error allocating KPK results of size %d.\nExiting...", KPK_POSITIONS);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < KPK_POSITIONS; i++)
+        results[i] = kpk_initial(i);
+
+    for (i = 0; i < num_threads; i++) {
+        jobs[i].results = results;
+        jobs[i].first_file = i;
+        jobs[i].file_step = num_threads;
+    }
+
+    for (i = 1; i < num_threads; i++)
+        pthread_create(&threads[i], NULL, kpk_worker, &jobs[i]);
+    kpk_worker(&jobs[0]);
+    for (i = 1; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    memset(KPK_BITBASE, 0, sizeof(KPK_BITBASE));
+    for (i = 0; i < KPK_POSITIONS; i++) {
+        if (results[i] == KPK_WIN)
+            KPK_BITBASE[i / 32] |= 1U << (i % 32);
+    }
+
+    free(results);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    KPK_GENERATION_MS = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+double kpk_generation_time() {
+    return KPK_GENERATION_MS;
+}
+
+// Whether the side with the pawn wins. The board must hold only the kings and
+// a single pawn.
+bool kpk_probe(Board *board) {
+    bool strong = (board->pieces[PAWN_IDX] & board->colors[BLACK]) != 0;
+    Sq wksq = LOG2(board->pieces[KING_IDX] & board->colors[strong]);
+    Sq bksq = LOG2(board->pieces[KING_IDX] & board->colors[!strong]);
+    Sq psq = LOG2(board->pieces[PAWN_IDX]);
+    bool stm = board->side_to_move != strong;
+    int idx;
+
+    if (strong == BLACK) { // flip ranks so the pawn moves north
+        wksq ^= 56;
+        bksq ^= 56;
+        psq ^= 56;
+    }
+
+    if (psq % 8 >= 4) { // mirror onto files a-d
+        wksq ^= 7;
+        bksq ^= 7;
+        psq ^= 7;
+    }
+
+    idx = kpk_index(stm, bksq, wksq, psq);
+    return KPK_BITBASE[idx / 32] & (1U << (idx % 32));
+}
@@ -1,39 +1,37 @@
 #include <ctype.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <wchar.h>  // used for unicode printing
 #include "board.h"
+#include "eval.h"
 #include "movegen.h"
+#include "nnue.h"
 #include "table.h"
 #include "utils.h" // includes <stdio.h>
 
-#define INITIAL_MOVE_CAPACITY 128
-#define HALF_MOVE_MASK 0x1ffff
+// move generation stages
+#define GEN_CAPTURES 0x1
+#define GEN_QUIETS   0x2
+#define GEN_ALL      (GEN_CAPTURES | GEN_QUIETS)
 
-Board* copy_board(Board *board) { // DEBUG
-    int i;
-    Board *copy = (Board*)malloc(sizeof(Board));
-    memset(copy, 0, sizeof(Board));
-    copy->stack_capacity = board->stack_capacity;
-    copy->state_stack = (StateFlags *)malloc(copy->stack_capacity * sizeof(StateFlags));
-    copy->hash_stack = (U64 *)malloc(copy->stack_capacity * sizeof(U64));
-
-    for (i = 0; i < NUM_COLORS; i++)
-        copy->colors[i] = board->colors[i];
+Board* new_board() {
+    Board *board = (Board*)aligned_alloc(CACHE_LINE, sizeof(Board));
 
-    for (i = 0; i < NUM_PIECES; i++)
-        copy->pieces[i] = board->pieces[i];
-
-    for (i = 0; i <= board->ply; i++)
-        copy->state_stack[i] = board->state_stack[i];
+    if (board == NULL) {
+        fprintf(stderr, "Error allocating board of size %lu.\nExiting...", sizeof(Board));
+        exit(EXIT_FAILURE);
+    }
 
-    for (i = 0; i <= board->ply; i++)
-        copy->hash_stack[i] = board->hash_stack[i];
+    return board;
+}
 
-    copy->ply = board->ply;
-    copy->side_to_move = board->side_to_move;
-    copy->ply_offset = board->ply_offset;
+Board* copy_board(Board *board) {
+    Board *copy = new_board();
+    memcpy(copy, board, offsetof(Board, history) + (board->ply + 1) * sizeof(History));
+    copy->acc = NULL; // the accumulator stack is not shared
+    copy->acc_stack = NULL;
 
     return copy;
 }
@@ -55,8 +53,16 @@ static bool boards_equal(Board *b1, Board *b2) { // DEBUG
             return false;
     }
 
+    for (i = 0; i < NUM_SQUARES; i++) {
+        if (b1->squares[i] != b2->squares[i])
+            return false;
+    }
+
+    if (b1->material_key != b2->material_key || b1->pawn_key != b2->pawn_key)
+        return false;
+
     for (i = 0; i <= b1->ply; i++) {
-        if (b1->state_stack[i] != b2->state_stack[i])
+        if (b1->history[i].state != b2->history[i].state || b1->history[i].psq != b2->history[i].psq)
             return false;
     }
 
@@ -64,6 +70,11 @@ static bool boards_equal(Board *b1, Board *b2) { // DEBUG
 }
 #endif
 
+// key term of the next piece of a kind, see material_hash
+static inline U64 material_term(Board *board, int piece, bool color) {
+    return ZOBRIST_MATERIAL[piece][color][POP_COUNT(board->pieces[piece] & board->colors[color])];
+}
+
 static U64 danger_squares(Board *board) {
     U64 aux1, aux2;
     U64 friendly = board->colors[board->side_to_move];
@@ -96,95 +107,64 @@ static U64 danger_squares(Board *board) {
     return danger_squares;
 }
 
-static U64 get_checkers(Board *board, bool color) {
-    U64 friendly = board->colors[color];
+// Enemy pieces of the given color attacking a set of squares with the given
+// occupancy. Kings are included.
+static U64 attackers_to(Board *board, U64 sq, U64 occ, bool color) {
     U64 enemy = board->colors[color^1];
-    U64 checkers = 0ULL;
-    U64 king = board->pieces[KING_IDX] & friendly;
+    U64 attackers = 0ULL;
     U64 aux;
 
-    aux = east_one(king) | west_one(king);
+    aux = east_one(sq) | west_one(sq);
     aux = color ? sout_one(aux) : nort_one(aux);
-    checkers |= aux & board->pieces[PAWN_IDX] & enemy;
-    checkers |= n_moves(king) & board->pieces[KNIGHT_IDX] & enemy;
-    aux = enemy | friendly;
-    checkers |= b_moves(king, aux) & (board->pieces[BISHOP_IDX] | board->pieces[QUEEN_IDX]) & enemy;
-    checkers |= r_moves(king, aux) & (board->pieces[ROOK_IDX  ] | board->pieces[QUEEN_IDX]) & enemy;
+    attackers |= aux & board->pieces[PAWN_IDX];
+    attackers |= n_moves(sq) & board->pieces[KNIGHT_IDX];
+    attackers |= b_moves(sq, occ) & (board->pieces[BISHOP_IDX] | board->pieces[QUEEN_IDX]);
+    attackers |= r_moves(sq, occ) & (board->pieces[ROOK_IDX  ] | board->pieces[QUEEN_IDX]);
+    attackers |= k_moves(sq) & board->pieces[KING_IDX];
 
-    return checkers;
+    return attackers & enemy;
 }
 
-static U64 ray_between(U64 from, U64 to) {
-    const int dx[8] = { 0,  1,  0, -1,  1, -1,  1, -1 };
-    const int dy[8] = { 1,  0, -1,  0,  1,  1, -1, -1 };
-    U64 ray, aux;
-    int i;
-
-    for (i = 0; i < 8; i++) {
-        ray = 0;
-        aux = from;
-        while (aux) {
-            aux = delta_one(aux, dx[i], dy[i]);
-            if (aux & to)
-                return ray;
-
-            ray |= aux;
-        }
-    }
+static U64 get_checkers(Board *board, bool color) {
+    U64 king = board->pieces[KING_IDX] & board->colors[color];
 
-    return 0;
+    return attackers_to(board, king, board->colors[WHITE] | board->colors[BLACK], color);
 }
 
+// Pieces of the given color that are absolutely pinned to their king. Enemy
+// sliders are found with x-ray attacks from the king (friendly pieces are
+// transparent), and a friendly piece pins if it is the only piece between.
 static U64 get_pins(Board *board, bool color) {
-    const int dx[8] = { 1, -1,  1, -1,  0,  1,  0, -1 };
-    const int dy[8] = { 1,  1, -1, -1,  1,  0, -1,  0 };
     U64 friendly = board->colors[color];
     U64 enemy = board->colors[color^1];
     U64 king = board->pieces[KING_IDX] & friendly;
-    U64 aux1, aux2, aux3;
-    U64 enem;
-    U64 opp;
+    Sq king_sq = LOG2(king);
+    U64 snipers, aux;
     U64 pins = 0ULL;
-    int i, j;
 
-    for (i = 0; i < 2; i++) {
-        aux1 = (board->pieces[BISHOP_IDX + i] | board->pieces[QUEEN_IDX]) & enemy;
-        while (aux1) {
-            aux2 = pop_lsb(&aux1);
-            for (j = i*4; j < (i+1)*4; j++) {
-                enem = 0ULL;
-                opp = 0ULL;
-                aux3 = aux2;
-                do {
-                    aux3 = delta_one(aux3, dx[j], dy[j]);
-                    enem |= aux3;
-                } while (aux3 & ~friendly & ~enemy);
-
-                aux3 = king;
-                do {
-                    aux3 = delta_one(aux3, -dx[j], -dy[j]);
-                    opp |= aux3;
-                } while (aux3 & ~friendly & ~enemy);
-
-                pins |= opp & enem & friendly;
-            }
-        }    
+    snipers  = r_moves(king, enemy) & (board->pieces[ROOK_IDX] | board->pieces[QUEEN_IDX]) & enemy;
+    snipers |= b_moves(king, enemy) & (board->pieces[BISHOP_IDX] | board->pieces[QUEEN_IDX]) & enemy;
+
+    while (snipers) {
+        aux = BETWEEN[king_sq][LOG2(pop_lsb(&snipers))] & (friendly | enemy);
+        if (aux && !(aux & (aux - 1)))
+            pins |= aux & friendly;
     }
 
     return pins;
 }
 
 static inline U64 ep_target(Board *board) {
-    StateFlags state = board->state_stack[board->ply];
+    StateFlags state = board->history[board->ply].state;
     return state & 0x04000000 ? 1ULL << ((state >> 20) & 0x3f) : 0ULL;
 }
 
 static inline bool can_castle(Board *board, bool color, bool side) {
-    return TEST_BIT(board->state_stack[board->ply], 27 + (side^1) + (color^1)*2);
+    return TEST_BIT(board->history[board->ply].state, 27 + (side^1) + (color^1)*2);
 }
 
 static int half_moves(Board *board) {
-    return board->state_stack[board->ply] & HALF_MOVE_MASK;
+    return board->history[board->ply].state & HALF_MOVE_MASK;
 }
 
 void make_move(Board *board, Move move) {
@@ -193,8 +173,9 @@ void make_move(Board *board, Move move) {
     U64 aux1, aux2;
     Sq sq;
     bool curr_color = board->side_to_move;
-    U64 next_hash = board->hash_stack[board->ply];
-    StateFlags next_state = board->state_stack[board->ply];
+    U64 next_hash = board->history[board->ply].hash;
+    int next_psq = board->history[board->ply].psq;
+    StateFlags next_state = board->history[board->ply].state;
     StateFlags prev_state = next_state;
     int i, j;
     
@@ -246,20 +227,22 @@ void make_move(Board *board, Move move) {
         board->pieces[ROOK_IDX] |= to; // add new pieces
         board->pieces[KING_IDX] |= aux2;
         board->colors[curr_color] |= to | aux2;
+        board->squares[LOG2(from)] = EMPTY_IDX;
+        board->squares[LOG2(aux1)] = EMPTY_IDX;
+        board->squares[LOG2(to)] = ROOK_IDX;
+        board->squares[LOG2(aux2)] = KING_IDX;
 
         next_hash ^= ZOBRIST_PIECE_SQ[ROOK_IDX][curr_color][LOG2(from)]; // update hash
         next_hash ^= ZOBRIST_PIECE_SQ[KING_IDX][curr_color][LOG2(aux1)];
         next_hash ^= ZOBRIST_PIECE_SQ[ROOK_IDX][curr_color][LOG2(to)];
         next_hash ^= ZOBRIST_PIECE_SQ[KING_IDX][curr_color][LOG2(aux2)];
+        next_psq += PSQ[ROOK_IDX][curr_color][LOG2(to)] - PSQ[ROOK_IDX][curr_color][LOG2(from)];
+        next_psq += PSQ[KING_IDX][curr_color][LOG2(aux2)] - PSQ[KING_IDX][curr_color][LOG2(aux1)];
 
         goto end; // gosh
     }
 
-    
-    for (i = 0; i < NUM_PIECES; i++) {
-        if (board->pieces[i] & from)
-            break;
-    }
+    i = board->squares[get_from(move)];
 
     if (i == PAWN_IDX)
         next_state &= 0xfffe0000; // clear half-move clock
@@ -269,18 +252,23 @@ void make_move(Board *board, Move move) {
         
         board->pieces[PAWN_IDX] &= ~aux1; // clear ep_captured pawn
         board->colors[curr_color ^ 1] &= ~aux1;
+        board->squares[LOG2(aux1)] = EMPTY_IDX;
 
         next_hash ^= ZOBRIST_PIECE_SQ[PAWN_IDX][curr_color ^ 1][LOG2(aux1)]; // update hash
+        next_psq -= PSQ[PAWN_IDX][curr_color ^ 1][LOG2(aux1)];
+        board->pawn_key ^= ZOBRIST_PIECE_SQ[PAWN_IDX][curr_color ^ 1][LOG2(aux1)];
+        board->material_key ^= material_term(board, PAWN_IDX, curr_color ^ 1);
     } else if (move & 0x4000) { // check if capture
-        for (j = 0; j < NUM_PIECES; j++) {
-            if (board->pieces[j] & to)
-                break;
-        }
+        j = board->squares[get_to(move)];
 
         board->pieces[j] &= ~to; // clear captured piece
         board->colors[curr_color ^ 1] &= ~to;
 
         next_hash ^= ZOBRIST_PIECE_SQ[j][curr_color ^ 1][LOG2(to)]; // update hash
+        next_psq -= PSQ[j][curr_color ^ 1][LOG2(to)];
+        board->material_key ^= material_term(board, j, curr_color ^ 1);
+        if (j == PAWN_IDX)
+            board->pawn_key ^= ZOBRIST_PIECE_SQ[PAWN_IDX][curr_color ^ 1][LOG2(to)];
 
         next_state |= j << 17; // store captured piece-index
         next_state &= 0xfffe0000; // clear half-move clock
@@ -312,8 +300,12 @@ void make_move(Board *board, Move move) {
 
     board->pieces[i] &= ~from;
     board->colors[curr_color] &= ~from;
+    board->squares[get_from(move)] = EMPTY_IDX;
 
     next_hash ^= ZOBRIST_PIECE_SQ[i][curr_color][LOG2(from)]; // update hash
+    next_psq -= PSQ[i][curr_color][LOG2(from)];
+    if (i == PAWN_IDX)
+        board->pawn_key ^= ZOBRIST_PIECE_SQ[PAWN_IDX][curr_color][LOG2(from)];
 
     if (move & 0x8000) { // check if promotion
         j = (move >> 12) & 3;
@@ -325,30 +317,32 @@ void make_move(Board *board, Move move) {
             i = ROOK_IDX;
         else
             i = QUEEN_IDX;
+
+        board->material_key ^= material_term(board, PAWN_IDX, curr_color);
+        board->material_key ^= material_term(board, i, curr_color);
     }
 
     board->pieces[i] |= to;
     board->colors[curr_color] |= to;
+    board->squares[get_to(move)] = i;
     next_hash ^= ZOBRIST_PIECE_SQ[i][curr_color][LOG2(to)]; // update hash
+    next_psq += PSQ[i][curr_color][LOG2(to)];
+    if (i == PAWN_IDX)
+        board->pawn_key ^= ZOBRIST_PIECE_SQ[PAWN_IDX][curr_color][LOG2(to)];
 
 end:
-    if (board->ply >= board->stack_capacity) {
-        board->stack_capacity *= 2;
-        board->state_stack = realloc(board->state_stack, sizeof(StateFlags) * board->stack_capacity);
-        board->hash_stack = realloc(board->hash_stack, sizeof(U64) * board->stack_capacity);
-        if (board->state_stack == NULL || board->hash_stack == NULL) {
-            fprintf(stderr, "Error allocating new state stack of size %d.\nExiting...", board->stack_capacity);
-            free(board);
-            exit(EXIT_FAILURE);
-        }
-    }
-    board->state_stack[board->ply] = next_state;
+    debug_assert(board->ply < STACK_CAPACITY, "state stack overflow");
+    board->history[board->ply].state = next_state;
     // update hash for castling
     prev_state = (prev_state >> 27) & 0xf;
     next_state = (next_state >> 27) & 0xf;
     next_hash ^= ZOBRIST_CASTLING[prev_state];
     next_hash ^= ZOBRIST_CASTLING[next_state];
-    board->hash_stack[board->ply] = next_hash;
+    board->history[board->ply].hash = next_hash;
+    board->history[board->ply].psq = next_psq;
+
+    if (board->acc)
+        nnue_push(board, move);
 }
 
 void unmake_move(Board *board, Move move) {
@@ -358,9 +352,11 @@ void unmake_move(Board *board, Move move) {
     board->side_to_move ^= 1;
     bool curr_color = board->side_to_move;
     int i, captured_piece_idx;
-    StateFlags next_state = board->state_stack[board->ply];
+    StateFlags next_state = board->history[board->ply].state;
 
     board->ply--;
+    if (board->acc)
+        board->acc--;
 
     if (((move >> 12) & 0b1110) == 0b10) { // check if castle
         from = 0x8100000000000081ULL; // rook origin
@@ -396,214 +392,440 @@ void unmake_move(Board *board, Move move) {
         board->pieces[ROOK_IDX] |= from; // add new pieces
         board->pieces[KING_IDX] |= aux1;
         board->colors[curr_color] |= from | aux1;
+        board->squares[LOG2(to)] = EMPTY_IDX;
+        board->squares[LOG2(aux2)] = EMPTY_IDX;
+        board->squares[LOG2(from)] = ROOK_IDX;
+        board->squares[LOG2(aux1)] = KING_IDX;
 
         return;
     }
 
-
-    for (i = 0; i < NUM_PIECES; i++) {
-        if (board->pieces[i] & to) {
-            break;
-        }
-    }
+    i = board->squares[get_to(move)];
 
     board->pieces[i] &= ~to;
     board->colors[curr_color] &= ~to;
-    
+    board->squares[get_to(move)] = EMPTY_IDX;
+
     if (move >> 12 == 5) { // check if ep capture
         aux1 = curr_color ? nort_one(to) : sout_one(to); // ep-captured pawn
-        
+        board->material_key ^= material_term(board, PAWN_IDX, curr_color ^ 1);
+
         board->pieces[PAWN_IDX] |= aux1;
         board->colors[curr_color ^ 1] |= aux1;
+        board->squares[LOG2(aux1)] = PAWN_IDX;
+        board->pawn_key ^= ZOBRIST_PIECE_SQ[PAWN_IDX][curr_color ^ 1][LOG2(aux1)];
     } else if (move & 0x4000) { // check if capture
-        captured_piece_idx = (next_state >> 17) & 0x07; // restore captured piece from state_stack
+        captured_piece_idx = (next_state >> 17) & 0x07; // restore captured piece from history
+        if (captured_piece_idx == PAWN_IDX)
+            board->pawn_key ^= ZOBRIST_PIECE_SQ[PAWN_IDX][curr_color ^ 1][LOG2(to)];
+        board->material_key ^= material_term(board, captured_piece_idx, curr_color ^ 1);
 
         board->pieces[captured_piece_idx] |= to;
         board->colors[curr_color ^ 1] |= to;
+        board->squares[get_to(move)] = captured_piece_idx;
     }
 
 
-    if (move & 0x8000) // check if promotion
+    if (move & 0x8000) { // check if promotion
+        board->material_key ^= material_term(board, i, curr_color);
         i = PAWN_IDX;
+        board->material_key ^= material_term(board, i, curr_color);
+    } else if (i == PAWN_IDX) {
+        board->pawn_key ^= ZOBRIST_PIECE_SQ[PAWN_IDX][curr_color][LOG2(to)];
+    }
+
+    if (i == PAWN_IDX)
+        board->pawn_key ^= ZOBRIST_PIECE_SQ[PAWN_IDX][curr_color][LOG2(from)];
 
     board->pieces[i] |= from;
     board->colors[curr_color] |= from;
+    board->squares[get_from(move)] = i;
+}
+
+static inline U64 pawn_push(U64 bb, bool color) {
+    return color ? sout_one(bb) : nort_one(bb);
+}
+
+// emits one move per target square, with the origin a fixed offset behind it
+static inline ScoredMove* add_pawn_moves(ScoredMove *list, U64 targets, int offset, MoveFlags flags) {
+    Sq to;
+
+    while (targets) {
+        to = LOG2(pop_lsb(&targets));
+        (list++)->move = new_move(to - offset, to, flags);
+    }
+
+    return list;
+}
+
+// emits a promotion for each piece in the flag range [first, last]
+static inline ScoredMove* add_promotions(ScoredMove *list, U64 targets, int offset, MoveFlags first, MoveFlags last) {
+    Sq to;
+    MoveFlags j;
+
+    while (targets) {
+        to = LOG2(pop_lsb(&targets));
+        for (j = first; j <= last; j++)
+            (list++)->move = new_move(to - offset, to, j);
+    }
+
+    return list;
+}
+
+static inline ScoredMove* add_piece_moves(ScoredMove *list, U64 from, U64 targets, U64 enemy) {
+    U64 aux;
+
+    while (targets) {
+        aux = pop_lsb(&targets);
+        (list++)->move = new_move(LOG2(from), LOG2(aux), aux & enemy ? 4 : 0);
+    }
+
+    return list;
 }
 
-Move* legal_moves(Board *board, Move *given) {
-    Move *list = given;
-    U64 aux1, aux2, aux3, aux4;
-    Sq from;
-    Move move;
-    int j;
+/*
+ * Generates the legal moves of a single stage.
+ *
+ * GEN_CAPTURES  captures, en passant and queen promotions
+ * GEN_QUIETS    quiet moves, castling and under-promotions
+ *
+ * When in check both stages only produce evasions, as every target outside of
+ * the check masks is filtered out.
+ */
+static ScoredMove* generate(Board *board, ScoredMove *list, int stage) {
+    U64 aux1, aux2, aux3, aux4, pinned, targets;
+    int up;
     bool curr_side = board->side_to_move;
     U64 friendly = board->colors[curr_side];
     U64 enemy = board->colors[curr_side ^ 1];
+    U64 empty = ~(friendly | enemy);
     U64 king = board->pieces[KING_IDX] & friendly;
     U64 ds = danger_squares(board);
     U64 checkers = get_checkers(board, curr_side);
     U64 pins = get_pins(board, curr_side);
     U64 capture_mask = -1;
     U64 push_mask = -1;
+    U64 stage_mask = ((stage & GEN_CAPTURES) ? enemy : 0ULL) | ((stage & GEN_QUIETS) ? empty : 0ULL);
 
     // king moves
-    from = LOG2(king);
-    aux2 = k_moves(king) & ~ds & ~friendly;
-    while (aux2) {
-        aux1 = pop_lsb(&aux2);
-        move = new_move(from, LOG2(aux1), aux1 & enemy ? 4 : 0);
-        *(list++) = move;
-    }
+    list = add_piece_moves(list, king, k_moves(king) & ~ds & stage_mask, enemy);
 
     if (POP_COUNT(checkers) > 1) { // double check or more
-        goto end; // no other pieces can move
+        return list; // no other pieces can move
     } else if (checkers) { // single check, create capture & push mask
         capture_mask = checkers;
-        push_mask = ray_between(board->pieces[KING_IDX] & friendly, checkers);
-    } else if (king & (curr_side ? 0x1000000000000000ULL : 0x0000000000000010)) { // if king is at home square
+        push_mask = BETWEEN[LOG2(king)][LOG2(checkers)];
+    } else if ((stage & GEN_QUIETS) && (king & (curr_side ? 0x1000000000000000ULL : 0x0000000000000010))) { // if king is at home square
         aux1 = curr_side ? 0x6e00000000000000ULL : 0x000000000000006eULL; // castle masks
         aux2 = 0x6000000000000060ULL & aux1;
         aux3 = curr_side ? 0x8000000000000000ULL : 0x0000000000000080ULL; // rook short castle home
         if (can_castle(board, curr_side, 0) && !(aux2 & (ds | friendly | enemy)) && (aux3 & board->pieces[ROOK_IDX])) // short_castle
-            *(list++) = curr_side ? MOVE_B_SHORT_CASTLE : MOVE_W_SHORT_CASTLE;
+            (list++)->move = curr_side ? MOVE_B_SHORT_CASTLE : MOVE_W_SHORT_CASTLE;
 
         aux2 = 0x0c0000000000000cULL & aux1;
         aux3 = curr_side ? 0x0100000000000000ULL : 0x0000000000000001ULL; // rook long castle home
         aux4 = curr_side ? 0x0200000000000000ULL : 0x0000000000000002ULL; // extra check outside of castle mask
         if (can_castle(board, curr_side, 1) && !(aux2 & (ds | friendly | enemy)) && (aux3 & board->pieces[ROOK_IDX]) && !((friendly | enemy) & aux4)) // long_castle
-            *(list++) = curr_side ? MOVE_B_LONG_CASTLE : MOVE_W_LONG_CASTLE;
+            (list++)->move = curr_side ? MOVE_B_LONG_CASTLE : MOVE_W_LONG_CASTLE;
     }
 
-    // pawn moves
+    // pawn moves, generated set-wise for all unpinned pawns at once
     aux1 = board->pieces[PAWN_IDX] & friendly;
-    while (aux1) {
-        aux2 = pop_lsb(&aux1);
-        aux3 = (curr_side ? sout_one(aux2) : nort_one(aux2)) & ~(enemy | friendly);
-
-        if (aux2 & pins) // if pawn is pinned
-            aux3 &= v_moves(king, (friendly | enemy) & ~aux2);
+    pinned = aux1 & pins;
+    up = curr_side ? -8 : 8;
+
+    // a pinned pawn can only push if it is pinned along the king's file
+    aux2 = pawn_push(aux1 & (~pins | (A_FILE << (LOG2(king) % 8))), curr_side) & empty;
+    aux3 = pawn_push(aux2 & (curr_side ? RANK_6 : RANK_3), curr_side) & empty & push_mask;
+    aux2 &= push_mask;
+    if (stage & GEN_CAPTURES)
+        list = add_pawn_moves(list, aux2 & (RANK_1 | RANK_8), up, PROMOTE_Q);
+    if (stage & GEN_QUIETS) {
+        list = add_promotions(list, aux2 & (RANK_1 | RANK_8), up, PROMOTE_N, PROMOTE_R);
+        list = add_pawn_moves(list, aux2 & ~(RANK_1 | RANK_8), up, 0);
+        list = add_pawn_moves(list, aux3, up * 2, DOUBLE_PUSH);
+    }
 
-        if (aux3 & (RANK_1 | RANK_8) & push_mask) { // if pawn promotion
-            for (j = 0; j < 4; j++) {
-                move = new_move(LOG2(aux2), LOG2(aux3), PROMOTE_N + j);
-                *(list++) = move;
-            }
-        } else if (aux3) { // single push
-            if (aux3 & push_mask)
-                *(list++) = new_move(LOG2(aux2), LOG2(aux3), 0);
-
-            aux4 = (curr_side ? sout_one(aux3) : nort_one(aux3)) & ~(enemy | friendly) & push_mask;
-            if (aux4 & (curr_side ? RANK_5 : RANK_4)) { // double push
-                move = new_move(LOG2(aux2), LOG2(aux4), DOUBLE_PUSH);
-                *(list++) = move;
-            }
+    if (stage & GEN_CAPTURES) {
+        aux1 &= ~pins;
+        aux4 = enemy & capture_mask;
+        aux2 = pawn_push(east_one(aux1), curr_side) & aux4;
+        aux3 = pawn_push(west_one(aux1), curr_side) & aux4;
+        list = add_promotions(list, aux2 & (RANK_1 | RANK_8), up + 1, PROMOTE_CAPTURE_N, PROMOTE_CAPTURE_Q);
+        list = add_pawn_moves(list, aux2 & ~(RANK_1 | RANK_8), up + 1, 4);
+        list = add_promotions(list, aux3 & (RANK_1 | RANK_8), up - 1, PROMOTE_CAPTURE_N, PROMOTE_CAPTURE_Q);
+        list = add_pawn_moves(list, aux3 & ~(RANK_1 | RANK_8), up - 1, 4);
+
+        // pinned pawns can only capture along the pin
+        while (pinned) {
+            aux2 = pop_lsb(&pinned);
+            aux1 = pawn_push(east_one(aux2) | west_one(aux2), curr_side) & aux4 & LINE[LOG2(king)][LOG2(aux2)];
+            if (aux1 & (RANK_1 | RANK_8))
+                list = add_promotions(list, aux1, LOG2(aux1) - LOG2(aux2), PROMOTE_CAPTURE_N, PROMOTE_CAPTURE_Q);
+            else if (aux1)
+                list = add_pawn_moves(list, aux1, LOG2(aux1) - LOG2(aux2), 4);
         }
-        U64 ep_targ = ep_target(board);
-        aux4 = curr_side ? sout_one(aux2) : nort_one(aux2);
-        aux3 = (east_one(aux4) | west_one(aux4)) & (enemy | ep_targ);
-        while (aux3) {
-            aux4 = pop_lsb(&aux3);
-            U64 captured_ep_mask = curr_side ? nort_one(ep_targ) : sout_one(ep_targ);
-            if ((aux4 & ep_targ) && ((captured_ep_mask & capture_mask) || (aux4 & push_mask))) {
-                U64 ep_discover_mask = ((friendly | enemy) & ~(captured_ep_mask | aux2)) | aux4;
-                if (!(r_moves(king, ep_discover_mask) & enemy & (board->pieces[QUEEN_IDX] | board->pieces[ROOK_IDX]))) { // if not ep discovered check
-                    if (!(aux2 & pins) || (b_moves(king, (friendly | enemy) & ~aux2) & aux4)) {
-                        move = new_move(LOG2(aux2), LOG2(aux4), EP_CAPTURE);
-                        *(list++) = move;
-                    }
-                }
-            } else if ((aux4 & (push_mask | capture_mask)) && (!(aux2 & pins) || ((b_moves(king, (friendly | enemy) & ~aux2) & aux4)
-                            && !(r_moves(king, (friendly | enemy) & ~aux2) & (board->pieces[ROOK_IDX] | board->pieces[QUEEN_IDX]) & enemy)))) { // FOR THE LOVE OF GOD FIX ME
-                if (aux4 & (RANK_1 | RANK_8)) {
-                    for (j = 0; j < 4; j++) {
-                        move = new_move(LOG2(aux2), LOG2(aux4), PROMOTE_CAPTURE_N + j);
-                        *(list++) = move;
-                    }
-                } else {
-                    move = new_move(LOG2(aux2), LOG2(aux4), 4);
-                    *(list++) = move;
-                }
+
+        aux4 = ep_target(board);
+        aux3 = curr_side ? nort_one(aux4) : sout_one(aux4); // ep-captured pawn
+        if (aux4 && ((aux3 & capture_mask) || (aux4 & push_mask))) {
+            aux1 = pawn_push(east_one(aux4) | west_one(aux4), curr_side ^ 1) & board->pieces[PAWN_IDX] & friendly;
+            while (aux1) {
+                aux2 = pop_lsb(&aux1);
+                // both pawns leave the board state at once, so test the king
+                // directly instead of relying on the pin mask
+                U64 occ = ((friendly | enemy) & ~(aux2 | aux3)) | aux4;
+                if (!(r_moves(king, occ) & enemy & (board->pieces[ROOK_IDX] | board->pieces[QUEEN_IDX]))
+                        && !(b_moves(king, occ) & enemy & (board->pieces[BISHOP_IDX] | board->pieces[QUEEN_IDX])))
+                    (list++)->move = new_move(LOG2(aux2), LOG2(aux4), EP_CAPTURE);
             }
         }
     }
 
-    // knight moves
-    aux1 = board->pieces[KNIGHT_IDX] & friendly;
+    targets = (push_mask | capture_mask) & stage_mask;
+
+    // knight moves, a pinned knight can never move
+    aux1 = board->pieces[KNIGHT_IDX] & friendly & ~pins;
     while (aux1) {
         aux2 = pop_lsb(&aux1);
-        aux3 = n_moves(aux2) & ~friendly;
-        while (aux3 && !(aux2 & pins)) {
-            aux4 = pop_lsb(&aux3);
-            if ((aux4 & push_mask) || (aux4 & capture_mask))
-                *(list++) = new_move(LOG2(aux2), LOG2(aux4), aux4 & enemy ? 4 : 0);
-        }
+        list = add_piece_moves(list, aux2, n_moves(aux2) & targets, enemy);
     }
     
     aux1 = board->pieces[BISHOP_IDX] & friendly;
     while (aux1) {
         aux2 = pop_lsb(&aux1);
-        aux3 = b_moves(aux2, friendly | enemy) & ~friendly;
+        aux3 = b_moves(aux2, friendly | enemy) & targets;
 
-        if (aux2 & pins) {
-            U64 pin_rays = b_moves(king, (friendly | enemy) & ~aux2);
-            if (!(pin_rays & enemy & (board->pieces[BISHOP_IDX] | board->pieces[QUEEN_IDX])))
-                pin_rays &= 0ULL;
+        if (aux2 & pins)
+            aux3 &= LINE[LOG2(king)][LOG2(aux2)];
 
-            aux3 &= pin_rays;
-        }
-
-        while (aux3) {
-            aux4 = pop_lsb(&aux3);
-            if ((aux4 & push_mask) || (aux4 & capture_mask))
-                *(list++) = new_move(LOG2(aux2), LOG2(aux4), aux4 & enemy ? 4 : 0);
-        }
+        list = add_piece_moves(list, aux2, aux3, enemy);
     }
     
     aux1 = board->pieces[ROOK_IDX] & friendly;
     while (aux1) {
         aux2 = pop_lsb(&aux1);
-        aux3 = r_moves(aux2, friendly | enemy) & ~friendly;
-
-        if (aux2 & pins) {
-            U64 pin_rays = r_moves(king, (friendly | enemy) & ~aux2);
-            if (!(pin_rays & enemy & (board->pieces[ROOK_IDX] | board->pieces[QUEEN_IDX])))
-                pin_rays &= 0ULL;
+        aux3 = r_moves(aux2, friendly | enemy) & targets;
 
-            aux3 &= pin_rays;
-        }
+        if (aux2 & pins)
+            aux3 &= LINE[LOG2(king)][LOG2(aux2)];
 
-        while (aux3) {
-            aux4 = pop_lsb(&aux3);
-            if ((aux4 & push_mask) || (aux4 & capture_mask))
-                *(list++) = new_move(LOG2(aux2), LOG2(aux4), aux4 & enemy ? 4 : 0);
-        }
+        list = add_piece_moves(list, aux2, aux3, enemy);
     }
     
     aux1 = board->pieces[QUEEN_IDX] & friendly;
     while (aux1) {
         aux2 = pop_lsb(&aux1);
-        aux3 = q_moves(aux2, friendly | enemy) & ~friendly;
-
-        if (aux2 & pins) {
-            aux4 = r_moves(king, (friendly | enemy) & ~aux2);
-            if (aux4 & (board->pieces[ROOK_IDX] | board->pieces[QUEEN_IDX]) & ~checkers & enemy) {
-                aux3 = aux4 & r_moves(aux2, friendly | enemy) & ~friendly;
-            } else {
-                aux4 = b_moves(king, (friendly | enemy) & ~aux2);
-                aux3 &= aux4 & b_moves(aux2, friendly | enemy) & ~friendly;
-            }
+        aux3 = q_moves(aux2, friendly | enemy) & targets;
+
+        if (aux2 & pins)
+            aux3 &= LINE[LOG2(king)][LOG2(aux2)];
+
+        list = add_piece_moves(list, aux2, aux3, enemy);
+    }
+
+    return list;
+}
+
+ScoredMove* legal_moves(Board *board, ScoredMove *list) {
+    return generate(board, list, GEN_ALL);
+}
+
+ScoredMove* capture_moves(Board *board, ScoredMove *list) {
+    return generate(board, list, GEN_CAPTURES);
+}
+
+ScoredMove* quiet_moves(Board *board, ScoredMove *list) {
+    return generate(board, list, GEN_QUIETS);
+}
+
+ScoredMove* evasion_moves(Board *board, ScoredMove *list) {
+    debug_assert(is_in_check(board), "evasions can only be generated while in check");
+    return generate(board, list, GEN_ALL);
+}
+
+// Number of legal moves in the position. Mirrors generate() but only adds up
+// the popcounts of each target set, so no moves are ever written.
+int count_legal_moves(Board *board) {
+    U64 aux1, aux2, aux3, aux4, pinned, targets;
+    int count;
+    bool curr_side = board->side_to_move;
+    U64 friendly = board->colors[curr_side];
+    U64 enemy = board->colors[curr_side ^ 1];
+    U64 occ = friendly | enemy;
+    U64 king = board->pieces[KING_IDX] & friendly;
+    U64 ds = danger_squares(board);
+    U64 checkers = get_checkers(board, curr_side);
+    U64 pins = get_pins(board, curr_side);
+    U64 capture_mask = -1;
+    U64 push_mask = -1;
+
+    count = POP_COUNT(k_moves(king) & ~ds & ~friendly);
+
+    if (POP_COUNT(checkers) > 1) {
+        return count;
+    } else if (checkers) {
+        capture_mask = checkers;
+        push_mask = BETWEEN[LOG2(king)][LOG2(checkers)];
+    } else if (king & (curr_side ? 0x1000000000000000ULL : 0x0000000000000010)) {
+        aux1 = curr_side ? 0x6e00000000000000ULL : 0x000000000000006eULL;
+        aux2 = 0x6000000000000060ULL & aux1;
+        aux3 = curr_side ? 0x8000000000000000ULL : 0x0000000000000080ULL;
+        count += can_castle(board, curr_side, 0) && !(aux2 & (ds | occ)) && (aux3 & board->pieces[ROOK_IDX]);
+
+        aux2 = 0x0c0000000000000cULL & aux1;
+        aux3 = curr_side ? 0x0100000000000000ULL : 0x0000000000000001ULL;
+        aux4 = curr_side ? 0x0200000000000000ULL : 0x0000000000000002ULL;
+        count += can_castle(board, curr_side, 1) && !(aux2 & (ds | occ)) && (aux3 & board->pieces[ROOK_IDX]) && !(occ & aux4);
+    }
+
+    // pawn pushes, each promotion square counts for four moves
+    aux1 = board->pieces[PAWN_IDX] & friendly;
+    pinned = aux1 & pins;
+    aux2 = pawn_push(aux1 & (~pins | (A_FILE << (LOG2(king) % 8))), curr_side) & ~occ;
+    aux3 = pawn_push(aux2 & (curr_side ? RANK_6 : RANK_3), curr_side) & ~occ & push_mask;
+    aux2 &= push_mask;
+    count += POP_COUNT(aux2) + 3 * POP_COUNT(aux2 & (RANK_1 | RANK_8)) + POP_COUNT(aux3);
+
+    // pawn captures
+    aux1 &= ~pins;
+    aux4 = enemy & capture_mask;
+    aux2 = pawn_push(east_one(aux1), curr_side) & aux4;
+    aux3 = pawn_push(west_one(aux1), curr_side) & aux4;
+    count += POP_COUNT(aux2) + 3 * POP_COUNT(aux2 & (RANK_1 | RANK_8));
+    count += POP_COUNT(aux3) + 3 * POP_COUNT(aux3 & (RANK_1 | RANK_8));
+
+    while (pinned) {
+        aux2 = pop_lsb(&pinned);
+        aux1 = pawn_push(east_one(aux2) | west_one(aux2), curr_side) & aux4 & LINE[LOG2(king)][LOG2(aux2)];
+        count += POP_COUNT(aux1) + 3 * POP_COUNT(aux1 & (RANK_1 | RANK_8));
+    }
+
+    aux4 = ep_target(board);
+    aux3 = curr_side ? nort_one(aux4) : sout_one(aux4);
+    if (aux4 && ((aux3 & capture_mask) || (aux4 & push_mask))) {
+        aux1 = pawn_push(east_one(aux4) | west_one(aux4), curr_side ^ 1) & board->pieces[PAWN_IDX] & friendly;
+        while (aux1) {
+            aux2 = pop_lsb(&aux1);
+            U64 ep_occ = (occ & ~(aux2 | aux3)) | aux4;
+            count += !(r_moves(king, ep_occ) & enemy & (board->pieces[ROOK_IDX] | board->pieces[QUEEN_IDX]))
+                    && !(b_moves(king, ep_occ) & enemy & (board->pieces[BISHOP_IDX] | board->pieces[QUEEN_IDX]));
         }
+    }
+
+    targets = (push_mask | capture_mask) & ~friendly;
+
+    aux1 = board->pieces[KNIGHT_IDX] & friendly & ~pins;
+    while (aux1)
+        count += POP_COUNT(n_moves(pop_lsb(&aux1)) & targets);
+
+    aux1 = (board->pieces[BISHOP_IDX] | board->pieces[QUEEN_IDX]) & friendly;
+    while (aux1) {
+        aux2 = pop_lsb(&aux1);
+        aux3 = b_moves(aux2, occ) & targets;
+        if (aux2 & pins)
+            aux3 &= LINE[LOG2(king)][LOG2(aux2)];
+        count += POP_COUNT(aux3);
+    }
 
-        while (aux3) {
-            aux4 = pop_lsb(&aux3);
-            if ((aux4 & push_mask) || (aux4 & capture_mask))
-                *(list++) = new_move(LOG2(aux2), LOG2(aux4), aux4 & enemy ? 4 : 0);
+    aux1 = (board->pieces[ROOK_IDX] | board->pieces[QUEEN_IDX]) & friendly;
+    while (aux1) {
+        aux2 = pop_lsb(&aux1);
+        aux3 = r_moves(aux2, occ) & targets;
+        if (aux2 & pins)
+            aux3 &= LINE[LOG2(king)][LOG2(aux2)];
+        count += POP_COUNT(aux3);
+    }
+
+    return count;
+}
+
+// Checks if a move (usually from the transposition table) is legal in the
+// current position without generating the full move list.
+bool is_legal(Board *board, Move move) {
+    bool curr_side = board->side_to_move;
+    U64 friendly = board->colors[curr_side];
+    U64 enemy = board->colors[curr_side ^ 1];
+    U64 occ = friendly | enemy;
+    U64 from = 1ULL << get_from(move);
+    U64 to = 1ULL << get_to(move);
+    U64 king = board->pieces[KING_IDX] & friendly;
+    U64 checkers, targets;
+    MoveFlags flags = move >> 12;
+    ScoredMove moves[256];
+    ScoredMove *curr, *end;
+    int i;
+
+    if (move == NULL_MOVE || !(from & friendly) || (to & friendly))
+        return false;
+
+    // castling & en passant are rare enough to verify against the full list
+    if (flags == 2 || flags == 3 || flags == EP_CAPTURE) {
+        curr = moves;
+        end = generate(board, curr, flags == EP_CAPTURE ? GEN_CAPTURES : GEN_QUIETS);
+        while (curr < end) {
+            if ((curr++)->move == move)
+                return true;
         }
+        return false;
     }
-    
-end:
-    *list = (list - given);
-    return list;
+
+    if (flags == 6 || flags == 7 || ((flags & 4) != 0) != ((to & enemy) != 0))
+        return false;
+
+    i = board->squares[get_from(move)];
+
+    if (i == PAWN_IDX) {
+        if (((flags & 8) != 0) != ((to & (RANK_1 | RANK_8)) != 0))
+            return false;
+
+        if (flags & 4) {
+            targets = pawn_push(east_one(from) | west_one(from), curr_side);
+        } else if (flags == DOUBLE_PUSH) {
+            targets = pawn_push(pawn_push(from & (curr_side ? RANK_7 : RANK_2), curr_side) & ~occ, curr_side);
+        } else {
+            targets = pawn_push(from, curr_side);
+        }
+
+        if (!(targets & to & ~(flags & 4 ? 0ULL : occ)))
+            return false;
+    } else {
+        if (flags & ~4)
+            return false;
+
+        switch (i) {
+            case KNIGHT_IDX:
+                targets = n_moves(from);
+                break;
+            case BISHOP_IDX:
+                targets = b_moves(from, occ);
+                break;
+            case ROOK_IDX:
+                targets = r_moves(from, occ);
+                break;
+            case QUEEN_IDX:
+                targets = q_moves(from, occ);
+                break;
+            default:
+                targets = k_moves(from);
+        }
+
+        if (!(targets & to))
+            return false;
+    }
+
+    if (i == KING_IDX)
+        return !attackers_to(board, to, occ ^ from, curr_side);
+
+    checkers = get_checkers(board, curr_side);
+    if (checkers) {
+        if (POP_COUNT(checkers) > 1)
+            return false;
+        if (!(to & (checkers | BETWEEN[LOG2(king)][LOG2(checkers)])))
+            return false;
+    }
+
+    return !(from & get_pins(board, curr_side)) || (to & LINE[LOG2(king)][LOG2(from)]);
 }
 
 bool is_in_check(Board *board) {
@@ -615,7 +837,7 @@ bool is_threefold(Board *board) {
     U64 hash = get_hash(board);
 
     for (i = 1; i <= board->ply; i++) {
-        if (hash == board->hash_stack[board->ply - i])
+        if (hash == board->history[board->ply - i].hash)
             reps++;
 
         if (reps == 2)
@@ -626,17 +848,18 @@ bool is_threefold(Board *board) {
 }
 
 U64 get_hash(Board *board) {
-    return board->hash_stack[board->ply];
+    return board->history[board->ply].hash;
 }
 
 Move random_move(Board *board) {
-    Move *curr = (Move[256]){0};
-    Move *end = legal_moves(board, curr);
+    ScoredMove moves[256];
+    ScoredMove *curr = moves;
+    ScoredMove *end = legal_moves(board, curr);
 
     if (curr == end)
         return 0;
 
-    return *(curr + (rand() % *end));
+    return curr[rand() % (end - curr)].move;
     
 }
 
@@ -700,25 +923,26 @@ U64 perft(Board *board, int depth) {
 #if DEBUG
     Board *copy;
 #endif
-    Move *curr = (Move[256]){0};
-    Move *end = legal_moves(board, curr);
-    U64 nodes = 0;
-
     if (depth == 1)
-        return *end;
+        return count_legal_moves(board);
+
+    ScoredMove moves[256];
+    ScoredMove *curr = moves;
+    ScoredMove *end = legal_moves(board, curr);
+    U64 nodes = 0;
 
     while (curr < end) {
 #if DEBUG
         copy = copy_board(board);
 #endif
-        make_move(board, *curr);
+        make_move(board, curr->move);
         nodes += perft(board, depth-1);
-        unmake_move(board, *curr);
+        unmake_move(board, curr->move);
 #if DEBUG
         if (!boards_equal(board, copy)) {
             printf("\nMAKE MOVE != UNMAKE MOVE FOR:");
-            print_move(*curr);
-            printf(" %lx\n", *curr >> 12);
+            print_move(curr->move);
+            printf(" %x\n", curr->move >> 12);
             print_board(copy);
             printf("\n");
             print_board(board);
@@ -736,10 +960,11 @@ void print_perft(Board *board, int depth) {
 #if DEBUG
     Board *copy;
 #endif
-    //clock_t start = clock(), end;
-    //double duration;
-    Move *curr = (Move[256]){0};
-    Move *end = legal_moves(board, curr);
+    clock_t start = clock();
+    double duration;
+    ScoredMove moves[256];
+    ScoredMove *curr = moves;
+    ScoredMove *end = legal_moves(board, curr);
     U64 total_nodes = 0;
     U64 curr_node = 0;
     
@@ -747,18 +972,18 @@ void print_perft(Board *board, int depth) {
 #if DEBUG
         copy = copy_board(board);
 #endif
-        make_move(board, *curr);
-        print_move(*curr);
+        make_move(board, curr->move);
+        print_move(curr->move);
         printf(": ");
         curr_node = perft(board, depth-1);
         printf("%lu\n", curr_node);
         total_nodes += curr_node;
-        unmake_move(board, *curr);
+        unmake_move(board, curr->move);
 #if DEBUG
         if (!boards_equal(board, copy)) {
             printf("\nMAKE MOVE != UNMAKE MOVE FOR:");
-            print_move(*curr);
-            printf(" %lx\n", *curr >> 12);
+            print_move(curr->move);
+            printf(" %x\n", curr->move >> 12);
             print_board(copy);
             printf("\n");
             print_board(board);
@@ -768,25 +993,22 @@ void print_perft(Board *board, int depth) {
 #endif
         curr++;
     }
-    //end = clock();
-    //duration = (double)(end - start) / CLOCKS_PER_SEC;
-    //printf("\nTotal nodes: %lu (%d nps)\n", total_nodes, (int)(total_nodes / duration));
+    duration = (double)(clock() - start) / CLOCKS_PER_SEC;
     printf("\nTotal nodes: %lu\n", total_nodes);
+    printf("Time:        %.0lf ms\n", duration * 1000);
+    printf("NPS:         %.0lf\n", total_nodes / MAX(duration, 1e-9));
 }
 
 
 Board* from_fen(char* fen) {
-    Board *board = (Board*)malloc(sizeof(Board));
-    memset(board, 0, sizeof(Board));
-    board->stack_capacity = INITIAL_MOVE_CAPACITY;
-    board->state_stack = (StateFlags *)malloc(board->stack_capacity * sizeof(StateFlags));
-    board->hash_stack = (U64 *)malloc(board->stack_capacity * sizeof(U64));
-    board->state_stack[0] = 1 << 31;
+    Board *board = new_board();
+    memset(board, 0, offsetof(Board, history));
+    board->history[0].state = 1 << 31;
+    memset(board->squares, EMPTY_IDX, sizeof(board->squares));
     U64 bb;
     int i, j, color_idx = 0, piece_idx = 0;
     char c;
 
-
     for (i = 0, j = 0; fen[i] != ' '; i++, j++) {
         c = fen[i];
         if (isdigit(c)) {
@@ -823,6 +1045,7 @@ Board* from_fen(char* fen) {
 
             board->colors[color_idx] |= bb;
             board->pieces[piece_idx] |= bb;
+            board->squares[LOG2(bb)] = piece_idx;
         }
     }
     //debug_assert(j == 63, "FEN translation for piece placement must equal 64");
@@ -838,16 +1061,16 @@ Board* from_fen(char* fen) {
             c = fen[i];
             switch (c) {
                 case 'K':
-                    board->state_stack[0] = SET_BIT(board->state_stack[0], 30);
+                    board->history[0].state = SET_BIT(board->history[0].state, 30);
                     break;
                 case 'Q':
-                    board->state_stack[0] = SET_BIT(board->state_stack[0], 29);
+                    board->history[0].state = SET_BIT(board->history[0].state, 29);
                     break;
                 case 'k':
-                    board->state_stack[0] = SET_BIT(board->state_stack[0], 28);
+                    board->history[0].state = SET_BIT(board->history[0].state, 28);
                     break;
                 case 'q':
-                    board->state_stack[0] = SET_BIT(board->state_stack[0], 27);
+                    board->history[0].state = SET_BIT(board->history[0].state, 27);
                     break;
                 default:
                     debug_assert(false, "FEN castling rights must be one of { k, q } uppercase/lowercase.");
@@ -859,11 +1082,11 @@ Board* from_fen(char* fen) {
     i++; 
 
     if (fen[i] != '-') // set ep square
-        board->state_stack[board->ply] |= (sq_from_str(fen + i++) << 20) | (1 << 26);
+        board->history[board->ply].state |= (sq_from_str(fen + i++) << 20) | (1 << 26);
 
     i += 2;
 
-    board->state_stack[board->ply] |= (atoi(fen + i) & 0x1ffff);
+    board->history[board->ply].state |= (atoi(fen + i) & 0x1ffff);
     for (; fen[i] != ' '; i++);
     i++;
 
@@ -872,7 +1095,10 @@ Board* from_fen(char* fen) {
         board->ply_offset++;
     for (; fen[i] != ' '; i++);
 
-    board->hash_stack[board->ply] = board_hash(board);
+    board->history[board->ply].hash = board_hash(board);
+    board->history[board->ply].psq = board_psq(board);
+    board->pawn_key = pawn_hash(board);
+    board->material_key = material_hash(board);
 
     return board;
 }
@@ -882,25 +1108,16 @@ char* to_fen(Board *board) {
     char to_add;
     int i, piece, color, gap = 0;
     bool found;
-    U64 d_bb;
     Sq sq;
-    StateFlags state = board->state_stack[board->ply];
+    StateFlags state = board->history[board->ply].state;
 
     ptr = fen;
 
     for (i = 0; i < NUM_SQUARES; i++) {
-        d_bb = 1ULL << ((i%8) + (7-i/8)*8);
-        found = false;
-        for (color = 0; color < 2 && !found; color++) {
-            for (piece = 0; piece < NUM_PIECES && !found; piece++) {
-                if (board->colors[color] & board->pieces[piece] & d_bb) {
-                    found = true;
-                }
-            }
-        }
-        color--;
-        piece--;
-        if (found) {
+        sq = (i%8) + (7-i/8)*8;
+        piece = board->squares[sq];
+        color = (board->colors[BLACK] >> sq) & 1;
+        if (piece != EMPTY_IDX) {
             if (gap) {
                 *ptr = gap+48;
                 gap = 0;
@@ -990,7 +1207,7 @@ char* to_fen(Board *board) {
 }
 
 void free_board(Board *board) {
-    free(board->state_stack);
+    free(board->acc_stack);
     free(board);
 }
 
@@ -1015,9 +1232,8 @@ void print_board_bb(Board *board) {
 }
 
 void print_board(Board *board) {
-    StateFlags state = board->state_stack[board->ply];
-    U64 bb;
-    int i, j, k, c, color, piece;
+    StateFlags state = board->history[board->ply].state;
+    int i, j, c, color, piece;
     char castle_rights[5];
     
     printf("           %c to move\n", board->side_to_move ? 'b' : 'w');
@@ -1030,37 +1246,32 @@ void print_board(Board *board) {
         printf("     %d ", i+1);
         for (j = 0; j < 8; j++) {
             c = i % 2 != j % 2 ? '.' : ',';
-            for (k = 0; k < NUM_PIECES * NUM_COLORS; k++) {
-                piece = k % NUM_PIECES;
-                color = k / NUM_PIECES;
-                bb = board->pieces[piece] & board->colors[color];
-                
-                if ((bb >> (j+i*8)) & 1ULL) {
-                    switch (piece) {
-                        case PAWN_IDX:
-                            c = 'p';
-                            break;
-                        case KNIGHT_IDX:
-                            c = 'n';
-                            break;
-                        case BISHOP_IDX:
-                            c = 'b';
-                            break;
-                        case ROOK_IDX:
-                            c = 'r';
-                            break;
-                        case QUEEN_IDX:
-                            c = 'q';
-                            break;
-                        case KING_IDX:
-                            c = 'k';
-                            break;
-                        default:
-                            c = '?';
-                    }
-                    c -= color ? 0 : 0x20;
-                    break;
+            piece = board->squares[j+i*8];
+            color = (board->colors[BLACK] >> (j+i*8)) & 1;
+            if (piece != EMPTY_IDX) {
+                switch (piece) {
+                    case PAWN_IDX:
+                        c = 'p';
+                        break;
+                    case KNIGHT_IDX:
+                        c = 'n';
+                        break;
+                    case BISHOP_IDX:
+                        c = 'b';
+                        break;
+                    case ROOK_IDX:
+                        c = 'r';
+                        break;
+                    case QUEEN_IDX:
+                        c = 'q';
+                        break;
+                    case KING_IDX:
+                        c = 'k';
+                        break;
+                    default:
+                        c = '?';
                 }
+                c -= color ? 0 : 0x20;
             }
             printf("%c ", c);
         }
@@ -1104,32 +1315,25 @@ void print_board(Board *board) {
     printf("\n");
 #if DEBUG
     /*for (i = 0; i <= board->ply; i++) {
-        printf("%x\n", board->state_stack[i]);
+        printf("%x\n", board->history[i].state);
     }
     printf("\n");*/
 #endif
 }
 
 void wprint_board(Board *board) {
-    StateFlags state = board->state_stack[board->ply];
-    U64 bb;
-    int i, j, k, c, color, piece;
+    StateFlags state = board->history[board->ply].state;
+    int i, j, c, color, piece;
     char castle_rights[5];
     wprintf(L"          %c to move\n", board->side_to_move ? 'b' : 'w');
     for (i = 7; i >= 0; i--) {
         wprintf(L"     %d ", i + 1);
         for (j = 0; j < 8; j++) {
             c = i % 2 != j % 2 ? '.' : ',';
-            for (k = 0; k < NUM_PIECES * NUM_COLORS; k++) {
-                piece = k % NUM_PIECES;
-                color = k / NUM_PIECES;
-                bb = board->pieces[piece] & board->colors[color];
-                
-                if ((bb >> (j+i*8)) & 1ULL) {
-                    c = 0x2654 + (NUM_PIECES - piece - 1) + (color ^ 1) * NUM_PIECES;
-                    break;
-                }
-            }
+            piece = board->squares[j+i*8];
+            color = (board->colors[BLACK] >> (j+i*8)) & 1;
+            if (piece != EMPTY_IDX)
+                c = 0x2654 + (NUM_PIECES - piece - 1) + (color ^ 1) * NUM_PIECES;
             wprintf(L"%lc ", c);
         }
         wprintf(L"\n");
@@ -1,42 +1,90 @@
 #include <math.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
+#include "bitbase.h"
 #include "board.h"
 #include "engine.h"
 #include "eval.h"
 #include "movegen.h"
+#include "nnue.h"
+#include "syzygy.h"
 #include "table.h"
 #include "utils.h" // includes <stdio.h>
 
 #define START_FEN "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
-
-volatile int STOP_SEARCH;
-volatile int SEARCH_TIME;
-volatile int SEARCHING;
-
-U64 NUM_NODES;
-U8 HIGHEST_DEPTH;
+#define BENCH_COPIES 100000
+#define PERFT_TT_SIZE 64
+#define BENCH_SEARCH_DEPTH 7
+#define BENCH_EVAL_DEPTH 3
+#define BENCH_NNUE_SEED 0x9e3779b97f4a7c15ULL
+
+// https://www.chessprogramming.org/Perft_Results
+static const int BENCH_TT_SIZES[] = { 16, 256, 1024 };
+
+static const struct {
+    char *fen;
+    int depth;
+} BENCH_PERFTS[] = {
+    { START_FEN, 5 },
+    { "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 4 },
+    { "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 6 },
+    { "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 5 },
+    { "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 4 },
+    { "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 4 },
+};
+
+static atomic_bool STOP_SEARCH;
+static volatile int SEARCHING;
 
 static pthread_t SEARCH_THREAD;
 static Board *CURR_BOARD;
 static bool UCI_DEBUG_ON = false;
+static int NUM_THREADS = DEFAULT_THREADS;
+static int TT_SIZE = DEFAULT_TT_SIZE;
+static int PERFT_THREADS = 1;
+static SearchContext CONTEXTS[MAX_THREADS];
+static volatile int BENCH_EVAL_SINK;
+static pthread_t HELPER_THREADS[MAX_THREADS];
+static Move TB_ROOT_MOVES[MAX_NUM_LEGAL_MOVES];
+static bool PERFT_TT_READY = false;
+
+/*
+ * Root moves of a `go perft` split across worker threads. Each worker takes
+ * the next unclaimed root move and searches it on its own board copy.
+ */
+typedef struct {
+    Board *board;
+    ScoredMove moves[MAX_NUM_LEGAL_MOVES];
+    U64 nodes[MAX_NUM_LEGAL_MOVES];
+    int count;
+    int depth;
+    atomic_int next;
+} PerftJob;
 
 // ~ debug ~
 static Move MOVE_HISTORY[64];
 static int MOVE_HISTORY_IDX;
 // ~ debug ~
 
-static void print_info(Board* board, U8 depth, double time) {
-    TTEntry* entry = tt_probe(get_hash(board));
+static double elapsed(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+static void print_info(Board* board, U8 depth, U8 seldepth, U64 nodes, U64 tbhits, double time) {
+    TTEntry entry, d_entry;
     int i = 0;
-    if (!entry)
+    if (!tt_probe(get_hash(board), &entry))
         return;
 
 
-    printf("info depth %d seldepth %d score ", depth, HIGHEST_DEPTH);
-    int tt_mate_depth = mate_depth(entry->score);
+    printf("info depth %d seldepth %d score ", depth, seldepth);
+    int tt_mate_depth = mate_depth(entry.score);
     if (tt_mate_depth) {
         int augmented = (tt_mate_depth + 1) / 2;
         if (tt_mate_depth % 2 == 0)
@@ -44,69 +92,127 @@ static void print_info(Board* board, U8 depth, double time) {
         printf("mate %d", augmented);
     } else {
         int side_coeff = (CURR_BOARD->side_to_move * (-2) + 1);
-        printf("cp %d", entry->score * side_coeff);
+        printf("cp %d", entry.score * side_coeff);
     }
 
-    TTEntry* d_entry = entry;
+    bool found = true;
+    d_entry = entry;
     Board* copy = copy_board(board);
-    if (entry->depth > 0)
+    if (entry.depth > 0)
         printf(" pv");
     
-    while (d_entry && i < entry->depth) {
+    // entries only keep 16 bits of the key, so check each move before playing it
+    while (found && i < entry.depth && is_legal(copy, d_entry.best)) {
         printf(" ");
-        print_move(d_entry->best);
+        print_move(d_entry.best);
 
-        make_move(copy, d_entry->best);
-        d_entry = tt_probe(board_hash(copy));
+        make_move(copy, d_entry.best);
+        found = tt_probe(board_hash(copy), &d_entry);
         i++;
     }
     free(copy);
 
-    if (NUM_NODES > 0) {
-        printf(" nodes %lu", NUM_NODES);
+    if (nodes > 0) {
+        printf(" nodes %lu", nodes);
     }
 
     if (time != 0) {
-        printf(" nps %.0lf", (double)(NUM_NODES / time));
+        printf(" nps %.0lf", (double)(nodes / time));
         printf(" time %.0lf", time * 1000);
     }
 
+    if (tbhits > 0)
+        printf(" tbhits %lu", tbhits);
+
     printf("\n");
 }
 
+// nodes searched by every thread since the start of the search
+static U64 searched_nodes() {
+    U64 nodes = 0;
+    int i;
+
+    for (i = 0; i < NUM_THREADS; i++)
+        nodes += __atomic_load_n(&CONTEXTS[i].nodes, __ATOMIC_RELAXED);
+
+    return nodes;
+}
+
+static U64 searched_tbhits() {
+    U64 tbhits = 0;
+    int i;
+
+    for (i = 0; i < NUM_THREADS; i++)
+        tbhits += __atomic_load_n(&CONTEXTS[i].tbhits, __ATOMIC_RELAXED);
+
+    return tbhits;
+}
+
+// Lazy SMP helper. Helpers search the same position as the main thread and
+// only share results through the transposition table. Every other helper
+// starts a ply deeper so the threads do not walk the same tree in lockstep.
+static void* search_helper(void* arg) {
+    SearchContext *ctx = (SearchContext*)arg;
+    U8 depth = 1 + (ctx - CONTEXTS) % 2;
+
+    while (!atomic_load(&STOP_SEARCH) && depth < MAX_SEARCH_DEPTH)
+        search_root(ctx, depth++);
+
+    return NULL;
+}
+
 static void* search(void* arg) {
-    Board *board = copy_board(CURR_BOARD);
     SearchParams params = *(SearchParams*)arg;
-    SEARCH_TIME = params.movetime;
-    TTEntry* entry;
+    SearchContext *ctx = &CONTEXTS[0];
+    Board *board;
+    TTEntry entry;
     U8 curr_depth = 0;
-    U64 hash = get_hash(board);
+    U64 hash = get_hash(CURR_BOARD);
     Move best = 0, ponder = 0;
-    clock_t start = clock(), end = clock();
+    SearchLimits limits = { .movetime = params.movetime };
+    int i, num_root_moves = 0;
+
+    free(arg);
+    clock_gettime(CLOCK_MONOTONIC, &limits.start);
+    for (i = 0; i < NUM_THREADS; i++)
+        init_search_context(&CONTEXTS[i], copy_board(CURR_BOARD), limits, &STOP_SEARCH);
+    board = ctx->board;
+
+    // every thread only searches the root moves that keep the tablebase result
+    if (TB_LARGEST && tb_covers(board)) {
+        num_root_moves = tb_root_moves(board, TB_ROOT_MOVES);
+        if (num_root_moves)
+            __atomic_store_n(&ctx->tbhits, ctx->tbhits + count_legal_moves(board), __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        CONTEXTS[i].root_moves = TB_ROOT_MOVES;
+        CONTEXTS[i].num_root_moves = num_root_moves;
+    }
+
+    for (i = 1; i < NUM_THREADS; i++)
+        pthread_create(&HELPER_THREADS[i], NULL, search_helper, &CONTEXTS[i]);
 
-    start_timer();
     do {
         curr_depth++;
 
-        NUM_NODES = 0;
-        start = clock();
-        eval(board, curr_depth);
-        end = clock();
-        entry = tt_probe(hash);
-
-        if (entry) {
-            best = entry->best;
+        search_root(ctx, curr_depth);
+        if (tt_probe(hash, &entry) && is_legal(board, entry.best)) {
+            best = entry.best;
             make_move(board, best);
-            entry = tt_probe(get_hash(board));
-            if (entry)
-                ponder = entry->best;
+            ponder = NULL_MOVE;
+            if (tt_probe(get_hash(board), &entry) && is_legal(board, entry.best))
+                ponder = entry.best;
             unmake_move(board, best);
         }
-        if (!STOP_SEARCH)
-            print_info(board, curr_depth, (double)(end - start) / CLOCKS_PER_SEC);
+        if (!atomic_load(&STOP_SEARCH))
+            print_info(board, curr_depth, ctx->seldepth, searched_nodes(), searched_tbhits(), elapsed(&limits.start));
         
-    } while (curr_depth < params.depth && !STOP_SEARCH);
-    STOP_SEARCH = 0;
+    } while (curr_depth < params.depth && !atomic_load(&STOP_SEARCH));
+
+    atomic_store(&STOP_SEARCH, true);
+    for (i = 1; i < NUM_THREADS; i++)
+        pthread_join(HELPER_THREADS[i], NULL);
+    atomic_store(&STOP_SEARCH, false);
 
     printf("bestmove ");
     print_move(best);
@@ -117,7 +223,8 @@ static void* search(void* arg) {
 
     printf("\n");
 
-    free_board(board);
+    for (i = 0; i < NUM_THREADS; i++)
+        free_board(CONTEXTS[i].board);
     SEARCHING = 0;
 
     return NULL;
@@ -129,11 +236,15 @@ void engine_init() {
     MOVE_HISTORY_IDX = 0;
     // ~ debug ~
 
-    STOP_SEARCH = 0;
+    atomic_init(&STOP_SEARCH, false);
     SEARCHING = 0;
     CURR_BOARD = NULL;
+    PERFT_THREADS = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), MAX_THREADS);
     init_move_lookup_tables();
+    init_kpk();
     init_zobrist();
+    init_psq();
+    set_nnue_backend(best_nnue_backend());
     resize_engine_table(DEFAULT_TT_SIZE);
 }
 
@@ -163,12 +274,72 @@ void engine_unmove() {
     unmake_move(CURR_BOARD, MOVE_HISTORY[MOVE_HISTORY_IDX]);
 }
 
+// clears the table in place instead of reallocating it
+void engine_new_game() {
+    stop_search();
+    tt_clear();
+    pawn_tt_clear();
+    material_tt_clear();
+}
+
 void engine_quit() {
     if (CURR_BOARD)
         free_board(CURR_BOARD);
+    nnue_unload();
+    tb_free();
+}
+
+void set_engine_threads(int num_threads) {
+    if (SEARCHING)
+        return;
+
+    NUM_THREADS = MIN(MAX(num_threads, 1), MAX_THREADS);
+}
+
+bool save_engine_table(char* path) {
+    if (SEARCHING)
+        return false;
+
+    return tt_save_file(path);
+}
+
+bool load_engine_table(char* path) {
+    int mb_size;
+
+    if (SEARCHING)
+        return false;
+
+    mb_size = tt_load_file(path);
+    if (mb_size < 0)
+        return false;
+
+    TT_SIZE = mb_size;
+    return true;
+}
+
+// An empty path switches back to the classic evaluation.
+bool set_engine_eval_file(char* path) {
+    if (SEARCHING)
+        return false;
+
+    if (*path == '\0' || !strcmp(path, "<empty>")) {
+        nnue_unload();
+        return true;
+    }
+
+    return nnue_load(path);
+}
+
+// An empty path switches tablebases off.
+bool set_engine_syzygy_path(char* path) {
+    if (SEARCHING)
+        return false;
+
+    return tb_init(path);
 }
 
 void resize_engine_table(int mb_size) {
+    TT_SIZE = mb_size;
     tt_set_size(mb_size);
 }
 
@@ -193,6 +364,8 @@ int set_position(char* fen, char** moves) {
 }
 
 void print_engine() {
+    int wdl, dtz;
+
     if (!CURR_BOARD)
         return;
 
@@ -203,14 +376,228 @@ void print_engine() {
         printf("Is Threefold:  %d\n", is_threefold(CURR_BOARD));
     }
     print_board(CURR_BOARD);
+    if (TB_LARGEST && tb_covers(CURR_BOARD) && tb_probe_wdl(CURR_BOARD, &wdl) && tb_probe_dtz(CURR_BOARD, &dtz))
+        printf("Tablebase: WDL %d DTZ %d\n", wdl, dtz);
+}
 
+// perft with subtree counts shared between threads through the perft table
+static U64 hashed_perft(Board *board, int depth) {
+    ScoredMove moves[MAX_NUM_LEGAL_MOVES];
+    ScoredMove *curr, *end;
+    U64 hash, nodes = 0;
+
+    if (depth == 0)
+        return 1;
+    if (depth == 1)
+        return count_legal_moves(board);
+
+    hash = get_hash(board);
+    if (perft_tt_probe(hash, depth, &nodes))
+        return nodes;
+
+    end = legal_moves(board, moves);
+    for (curr = moves; curr < end; curr++) {
+        make_move(board, curr->move);
+        nodes += hashed_perft(board, depth - 1);
+        unmake_move(board, curr->move);
+    }
+
+    perft_tt_save(hash, depth, nodes);
+    return nodes;
+}
+
+static void* perft_worker(void *arg) {
+    PerftJob *job = (PerftJob*)arg;
+    Board *board = copy_board(job->board);
+    int i;
+
+    while ((i = atomic_fetch_add(&job->next, 1)) < job->count) {
+        make_move(board, job->moves[i].move);
+        job->nodes[i] = hashed_perft(board, job->depth - 1);
+        unmake_move(board, job->moves[i].move);
+    }
+
+    free_board(board);
+    return NULL;
 }
 
 void go_perft(int depth) {
-    if (!CURR_BOARD)
+    pthread_t threads[MAX_THREADS];
+    struct timespec start;
+    double duration;
+    PerftJob job;
+    U64 total_nodes = 0;
+    int i, num_threads;
+
+    if (!CURR_BOARD || depth < 1)
         return;
 
-    print_perft(CURR_BOARD, depth);
+    if (!PERFT_TT_READY) {
+        perft_tt_set_size(PERFT_TT_SIZE);
+        PERFT_TT_READY = true;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    job.board = CURR_BOARD;
+    job.count = legal_moves(CURR_BOARD, job.moves) - job.moves;
+    job.depth = depth;
+    atomic_init(&job.next, 0);
+
+    num_threads = MIN(PERFT_THREADS, MAX(job.count, 1));
+    for (i = 1; i < num_threads; i++)
+        pthread_create(&threads[i], NULL, perft_worker, &job);
+    perft_worker(&job);
+    for (i = 1; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    duration = elapsed(&start);
+
+    for (i = 0; i < job.count; i++) {
+        print_move(job.moves[i].move);
+        printf(": %lu\n", job.nodes[i]);
+        total_nodes += job.nodes[i];
+    }
+
+    printf("\nTotal nodes: %lu\n", total_nodes);
+    printf("Time:        %.0lf ms\n", duration * 1000);
+    printf("NPS:         %.0lf\n", total_nodes / MAX(duration, 1e-9));
+}
+
+void bench_perft() {
+    struct timespec start;
+    double duration, total_time = 0;
+    U64 nodes, total_nodes = 0;
+    Board *board, *copy;
+    size_t i;
+    int j;
+
+    for (i = 0; i < sizeof(BENCH_PERFTS) / sizeof(BENCH_PERFTS[0]); i++) {
+        board = from_fen(BENCH_PERFTS[i].fen);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        nodes = perft(board, BENCH_PERFTS[i].depth);
+        duration = elapsed(&start);
+        printf("perft %d %-10lu %s\n", BENCH_PERFTS[i].depth, nodes, BENCH_PERFTS[i].fen);
+        total_nodes += nodes;
+        total_time += duration;
+        free_board(board);
+    }
+
+    board = from_fen(START_FEN);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (j = 0; j < BENCH_COPIES; j++) {
+        copy = copy_board(board);
+        free_board(copy);
+    }
+    duration = elapsed(&start);
+    free_board(board);
+
+    printf("\nTotal nodes: %lu\n", total_nodes);
+    printf("Time:        %.0lf ms\n", total_time * 1000);
+    printf("NPS:         %.0lf\n", total_nodes / total_time);
+    printf("Board copy:  %.0lf ns\n", duration * 1000000000 / BENCH_COPIES);
+}
+
+// Fixed depth searches of the bench positions for every table size. Compare
+// builds with and without PREFETCH to see what prefetching buys.
+void bench_search() {
+    struct timespec start;
+    double duration;
+    SearchContext *ctx = &CONTEXTS[0];
+    atomic_bool stop = false;
+    U64 nodes;
+    size_t i, j;
+
+    if (SEARCHING)
+        return;
+
+    printf("TT prefetch: %s\n", TT_PREFETCH ? "on" : "off");
+    for (i = 0; i < sizeof(BENCH_TT_SIZES) / sizeof(BENCH_TT_SIZES[0]); i++) {
+        tt_set_size(BENCH_TT_SIZES[i]);
+        tt_new_search();
+        pawn_tt_clear();
+        pawn_tt_reset_stats();
+        nodes = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (j = 0; j < sizeof(BENCH_PERFTS) / sizeof(BENCH_PERFTS[0]); j++) {
+            init_search_context(ctx, from_fen(BENCH_PERFTS[j].fen), (SearchLimits){0}, &stop);
+            search_root(ctx, BENCH_SEARCH_DEPTH);
+            nodes += ctx->nodes;
+            free_board(ctx->board);
+        }
+
+        duration = elapsed(&start);
+        printf("Hash %5d MB  nodes %-10lu time %6.0lf ms  nps %-9.0lf pawn hits %.1lf%%\n",
+                BENCH_TT_SIZES[i], nodes, duration * 1000, nodes / duration, pawn_tt_hit_rate() * 100);
+    }
+
+    tt_set_size(TT_SIZE);
+}
+
+static U64 eval_leaves(Board *board, int depth) {
+    ScoredMove moves[MAX_NUM_LEGAL_MOVES], *curr, *end;
+    U64 evals = 0;
+
+    if (depth == 0) {
+        BENCH_EVAL_SINK += evaluate(board);
+        return 1;
+    }
+
+    end = legal_moves(board, moves);
+    for (curr = moves; curr < end; curr++) {
+        make_move(board, curr->move);
+        evals += eval_leaves(board, depth - 1);
+        unmake_move(board, curr->move);
+    }
+
+    return evals;
+}
+
+static void bench_eval_path(const char* name, bool use_nnue) {
+    struct timespec start;
+    double duration;
+    Board *board;
+    U64 evals = 0;
+    size_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < sizeof(BENCH_PERFTS) / sizeof(BENCH_PERFTS[0]); i++) {
+        board = from_fen(BENCH_PERFTS[i].fen);
+        if (use_nnue)
+            nnue_attach(board);
+        evals += eval_leaves(board, BENCH_EVAL_DEPTH);
+        free_board(board);
+    }
+    duration = elapsed(&start);
+
+    printf("%-12s evals %-9lu time %6.0lf ms  evals/s %.0lf\n",
+            name, evals, duration * 1000, evals / duration);
+}
+
+// Evaluates every leaf of a shallow tree from each bench position, so the
+// NNUE figures include the accumulator updates done by make_move. Without an
+// EvalFile an untrained network of the same shape is timed instead.
+void bench_eval() {
+    bool loaded;
+
+    if (SEARCHING)
+        return;
+
+    loaded = nnue_enabled();
+    if (!loaded)
+        nnue_init_random(BENCH_NNUE_SEED);
+    printf("NNUE network: %s\n", loaded ? "EvalFile" : "untrained");
+
+    bench_eval_path("classic", false);
+    set_nnue_backend(NNUE_SCALAR);
+    bench_eval_path("nnue scalar", true);
+    if (best_nnue_backend() == NNUE_AVX2) {
+        set_nnue_backend(NNUE_AVX2);
+        bench_eval_path("nnue avx2", true);
+    }
+
+    set_nnue_backend(best_nnue_backend());
+    if (!loaded)
+        nnue_unload();
 }
 
 void go_random() {
@@ -233,6 +620,7 @@ void start_search(SearchParams params) {
     }
 
     SEARCHING = 1;
+    tt_new_search();
     pthread_create(&SEARCH_THREAD, NULL, search, ptr);
 }
 
@@ -241,7 +629,7 @@ int stop_search() {
     if (!SEARCHING)
         return 0;
 
-    STOP_SEARCH = 1;
+    atomic_store(&STOP_SEARCH, true);
     pthread_join(SEARCH_THREAD, NULL);
 
     return 1;
@@ -1,24 +1,42 @@
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include "bitbase.h"
 #include "eval.h"
+#include "nnue.h"
+#include "syzygy.h"
 #include "utils.h"
 #include "table.h"
 #include "types.h"
 
 #define INF (2 << 16)
+#define KILLER_SCORE INT16_MAX
+#define KNOWN_WIN 10000 // won endgames score above any middlegame advantage
 
-extern volatile int STOP_SEARCH;
-extern volatile int SEARCH_TIME;
-extern U64 NUM_NODES;
-extern U8 HIGHEST_DEPTH;
-struct timespec START_TIME, END_TIME;
+int PSQ[NUM_PIECES][NUM_COLORS][NUM_SQUARES];
+
+const int PHASE_WEIGHTS[NUM_PIECES] = { 0, 1, 1, 2, 4, 0 };
 
 const int PIECE_VALUES[] = {
     PAWN_CP, KNIGHT_CP, BISHOP_CP,
     ROOK_CP, QUEEN_CP, 0
 };
 
+// pawn structure terms, indexed by rank relative to the pawn's side
+static const int PASSED_PAWN[8] = {
+    0, MAKE_SCORE(5, 10), MAKE_SCORE(5, 15), MAKE_SCORE(10, 25),
+    MAKE_SCORE(20, 45), MAKE_SCORE(35, 75), MAKE_SCORE(55, 120), 0
+};
+static const int ISOLATED_PAWN = MAKE_SCORE(-10, -15);
+static const int DOUBLED_PAWN  = MAKE_SCORE(-10, -20);
+static const int BACKWARD_PAWN = MAKE_SCORE(-8, -10);
+
+// material imbalance terms
+static const int BISHOP_PAIR = MAKE_SCORE(30, 50);
+static const int KNIGHT_PER_PAWN = MAKE_SCORE(6, 6);  // per own pawn above 5
+static const int ROOK_PER_PAWN = MAKE_SCORE(-12, -12); // per own pawn above 5
+
 // All tables were taken from:
 // https://www.chessprogramming.org/Simplified_Evaluation_Function#Piece-Square_Tables
 static const int PIECE_SQUARE_TABLE[NUM_PIECES + 1][NUM_SQUARES] = {
@@ -88,51 +106,205 @@ static const int PIECE_SQUARE_TABLE[NUM_PIECES + 1][NUM_SQUARES] = {
     }
 };
 
-static int should_stop_search(U8 depth) {
-    if (STOP_SEARCH)
-        return 1;
+static bool should_stop_search(SearchContext *ctx, U8 depth) {
+    struct timespec now;
 
-    if (depth <= 4)
-        return 0;
+    if (atomic_load_explicit(ctx->stop, memory_order_relaxed))
+        return true;
 
-    if (SEARCH_TIME > 0) {
-        clock_gettime(CLOCK_MONOTONIC, &END_TIME);
-        double duration = (END_TIME.tv_sec - START_TIME.tv_sec);
-        duration += (END_TIME.tv_nsec - START_TIME.tv_nsec) / 1000000000.0;
-        //SEARCH_TIME -= (int)round(duration*1000);
-        if ((int)round(duration*1000) >= SEARCH_TIME) {
-            STOP_SEARCH = 1; // TODO not atomic
+    if (depth <= 4)
+        return false;
+
+    if (ctx->limits.movetime > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double duration = (now.tv_sec - ctx->limits.start.tv_sec);
+        duration += (now.tv_nsec - ctx->limits.start.tv_nsec) / 1000000000.0;
+        if ((int)round(duration*1000) >= ctx->limits.movetime) {
+            atomic_store_explicit(ctx->stop, true, memory_order_relaxed);
+            return true;
         }
     }
     
-    return 0;
+    return false;
+}
+
+/*
+ * Staged move picker. The transposition table move is tried before anything
+ * is generated, then captures, and quiet moves are only generated once every
+ * capture has failed to produce a cutoff. Quiets are ordered killers first,
+ * then by history. In check all evasions are generated at once.
+ */
+typedef struct {
+    Board *board;
+    SearchContext *ctx;
+    U8 ply;
+    Move tt_move;
+    int stage;
+    bool in_check;
+    bool captures_only;
+    ScoredMove *curr;
+    ScoredMove *end;
+    ScoredMove moves[256];
+} MovePicker;
+
+enum {
+    PICK_TT,
+    PICK_GEN_CAPTURES,
+    PICK_CAPTURES,
+    PICK_GEN_QUIETS,
+    PICK_QUIETS,
+    PICK_GEN_EVASIONS,
+    PICK_EVASIONS,
+    PICK_DONE
+};
+
+static void init_picker(MovePicker *mp, SearchContext *ctx, U8 ply, Move tt_move, bool in_check, bool captures_only) {
+    Board *board = ctx->board;
+
+    mp->board = board;
+    mp->ctx = ctx;
+    mp->ply = ply;
+    mp->tt_move = NULL_MOVE;
+    mp->in_check = in_check;
+    mp->captures_only = captures_only;
+    mp->curr = mp->end = mp->moves;
+    mp->stage = in_check ? PICK_GEN_EVASIONS : PICK_GEN_CAPTURES;
+
+    if (tt_move && is_legal(board, tt_move)) {
+        mp->tt_move = tt_move;
+        mp->stage = PICK_TT;
+    }
 }
 
-void reorder_moves(Move* list, int n, Move pv) {
-    // TODO better reordering
-    if (!pv) {
-        fprintf(stderr, "ERROR: passing null principle variation move to move reording\n");
-        return;
+// most valuable victim, least valuable attacker
+static void score_captures(MovePicker *mp) {
+    ScoredMove *curr;
+    int victim;
+
+    for (curr = mp->curr; curr < mp->end; curr++) {
+        victim = mp->board->squares[get_to(curr->move)];
+        if (victim == EMPTY_IDX)
+            victim = (curr->move >> 12) == EP_CAPTURE ? PAWN_IDX : 0;
+
+        curr->score = victim * 8 + KING_IDX - mp->board->squares[get_from(curr->move)];
+        if (((curr->move >> 12) & PROMOTE_Q) == PROMOTE_Q)
+            curr->score += QUEEN_IDX * 8;
     }
+}
 
-    int i;
+static void score_quiets(MovePicker *mp) {
+    ScoredMove *curr;
+    Move *killers = mp->ctx->killers[mp->ply];
+    int (*history)[NUM_SQUARES] = mp->ctx->history[mp->board->side_to_move];
+
+    for (curr = mp->curr; curr < mp->end; curr++) {
+        if (curr->move == killers[0])
+            curr->score = KILLER_SCORE;
+        else if (curr->move == killers[1])
+            curr->score = KILLER_SCORE - 1;
+        else
+            curr->score = MIN(history[get_from(curr->move)][get_to(curr->move)], KILLER_SCORE - 2);
+    }
+}
 
-    for (i = 0; i < n && list[i] != pv; i++);
+// moves the best scored remaining move to the front and returns it
+static Move pick_best(MovePicker *mp) {
+    ScoredMove *curr, *best = mp->curr;
+    ScoredMove temp;
 
-    if (i == n) {
-        fprintf(stderr, "ERROR: principle variation move not present in legal move list\n");
-        return;
+    for (curr = mp->curr + 1; curr < mp->end; curr++) {
+        if (curr->score > best->score)
+            best = curr;
     }
 
-    Move temp = list[0];
-    list[0] = pv;
-    list[i] = temp;
+    temp = *mp->curr;
+    *mp->curr = *best;
+    *best = temp;
+
+    return (mp->curr++)->move;
+}
+
+static Move next_move(MovePicker *mp) {
+    Move move;
+
+    while (1) {
+        switch (mp->stage) {
+            case PICK_TT:
+                mp->stage = mp->in_check ? PICK_GEN_EVASIONS : PICK_GEN_CAPTURES;
+                return mp->tt_move;
+            case PICK_GEN_CAPTURES:
+                mp->curr = mp->moves;
+                mp->end = capture_moves(mp->board, mp->moves);
+                score_captures(mp);
+                mp->stage = PICK_CAPTURES;
+                break;
+            case PICK_GEN_QUIETS:
+                mp->curr = mp->moves;
+                mp->end = quiet_moves(mp->board, mp->moves);
+                score_quiets(mp);
+                mp->stage = PICK_QUIETS;
+                break;
+            case PICK_GEN_EVASIONS:
+                mp->curr = mp->moves;
+                mp->end = evasion_moves(mp->board, mp->moves);
+                mp->stage = PICK_EVASIONS;
+                break;
+            case PICK_CAPTURES:
+            case PICK_QUIETS:
+                while (mp->curr < mp->end) {
+                    move = pick_best(mp);
+                    if (move != mp->tt_move)
+                        return move;
+                }
+
+                if (mp->stage == PICK_CAPTURES && !mp->captures_only)
+                    mp->stage = PICK_GEN_QUIETS;
+                else
+                    mp->stage = PICK_DONE;
+                break;
+            case PICK_EVASIONS:
+                while (mp->curr < mp->end) {
+                    move = (mp->curr++)->move;
+                    if (move != mp->tt_move)
+                        return move;
+                }
+
+                mp->stage = PICK_DONE;
+                break;
+            default:
+                return NULL_MOVE;
+        }
+    }
+}
+
+// Exact result of king & pawn against king, positive for white. Wins score
+// higher the further the pawn is, so the search keeps pushing it.
+static int kpk_score(Board *board) {
+    bool strong = (board->pieces[PAWN_IDX] & board->colors[BLACK]) != 0;
+    Sq psq = LOG2(board->pieces[PAWN_IDX]);
+    int score;
+
+    if (!kpk_probe(board))
+        return 0;
+
+    score = KNOWN_WIN + PAWN_CP + 10 * (strong ? 7 - psq / 8 : psq / 8);
+    return strong ? -score : score;
 }
 
-int quiesce(Board *board, int alpha, int beta) {
-    int score, best = piece_eval(board);
+// Search counters are read by other threads while their owner updates them.
+// Only the owner writes, so a relaxed store of the incremented value is
+// enough and still compiles to a plain add.
+static inline void increment(U64 *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
 
-    NUM_NODES++;
+int quiesce(SearchContext *ctx, int alpha, int beta) {
+    Board *board = ctx->board;
+    int score, best = evaluate(board);
+    MovePicker mp;
+    Move move;
+
+    increment(&ctx->nodes);
 
     if (best >= beta)
         return best;
@@ -140,17 +312,12 @@ int quiesce(Board *board, int alpha, int beta) {
     if (best > alpha)
         alpha = best;
 
-    Move *curr = (Move[256]){0};
-    Move *end = legal_moves(board, curr);
+    init_picker(&mp, ctx, 0, NULL_MOVE, false, true);
 
-    while (curr < end) {
-        if (!is_capture(*curr)) {
-            curr++;
-            continue;
-        }
-        make_move(board, *curr);
-        score = -quiesce(board, -beta, -alpha);
-        unmake_move(board, *curr);
+    while ((move = next_move(&mp))) {
+        make_move(board, move);
+        score = -quiesce(ctx, -beta, -alpha);
+        unmake_move(board, move);
 
         if (score > best)
             best = score;
@@ -160,107 +327,142 @@ int quiesce(Board *board, int alpha, int beta) {
 
         if (score > alpha)
             alpha = score;
-
-        curr++;
     }
 
     return best;
 }
 
-int alphabeta(Board *board, int alpha, int beta, U8 depth, U8 ply) {
+static void update_quiet_stats(SearchContext *ctx, Move move, U8 depth, U8 ply) {
+    Move *killers = ctx->killers[ply];
+    int *history = &ctx->history[ctx->board->side_to_move][get_from(move)][get_to(move)];
+
+    if (killers[0] != move) {
+        killers[1] = killers[0];
+        killers[0] = move;
+    }
+
+    *history = MIN(*history + depth * depth, KILLER_SCORE);
+}
+
+static bool is_root_move(SearchContext *ctx, Move move) {
+    int i;
+
+    for (i = 0; i < ctx->num_root_moves; i++) {
+        if (ctx->root_moves[i] == move)
+            return true;
+    }
+
+    return false;
+}
+
+int alphabeta(SearchContext *ctx, int alpha, int beta, U8 depth, U8 ply) {
+    Board *board = ctx->board;
     bool preempted = false;
-    NUM_NODES++;
-    if (ply > HIGHEST_DEPTH)
-        HIGHEST_DEPTH = ply;
+    bool in_check;
+    int moves_searched = 0;
+    MovePicker mp;
+    Move move;
+    increment(&ctx->nodes);
+    if (ply > ctx->seldepth)
+        ctx->seldepth = ply;
     
     if (is_threefold(board)) {
         return 0; // TODO contempt score
     }
-    if (depth == 0)
-        return quiesce(board, alpha, beta);
 
-    TTEntry* tt_entry = tt_probe(get_hash(board));
-    if (tt_entry && (tt_entry->depth >= depth)) {
-        if (tt_entry->type == EXACT_NODE) {
-            return tt_entry->score;
-        } else if (tt_entry->type == ALL_NODE && tt_entry->score <= alpha) {
-            return alpha;
-        } else if (tt_entry->type == CUT_NODE  && tt_entry->score >= beta) {
-            return beta;
-        }
+    // king & pawn against king is known exactly, nothing to search below it
+    if (ply && POP_COUNT(board->colors[WHITE] | board->colors[BLACK]) == 3 && board->pieces[PAWN_IDX]) {
+        int score = kpk_score(board);
+        return board->side_to_move ? -score : score;
     }
-    if (tt_entry && tt_entry->score > CHECKMATE_CP)
-        depth = tt_entry->depth;
 
-    Move *curr = (Move[256]){0};
-    Move *end = legal_moves(board, curr);
+    // the tables score a position as if its half-move clock was just reset.
+    // The score depends on ply, which the TT does not adjust for, so it is not
+    // saved there; probing again is cheap.
+    if (ply && TB_LARGEST && !(board->history[board->ply].state & HALF_MOVE_MASK) && tb_covers(board)) {
+        int wdl;
+        if (tb_probe_wdl(board, &wdl)) {
+            increment(&ctx->tbhits);
+            return wdl == TB_WIN ? TB_WIN_CP - ply : wdl == TB_LOSS ? -TB_WIN_CP + ply : 0;
+        }
+    }
 
-    if (curr == end) {
-        if (is_in_check(board)) {
-            // mate
-            //int side_coeff = (board->side_to_move * (-2) + 1);
-            return -(CHECKMATE_CP + 99 - ply);
-        } else {
-            // stalemate
-            return 0; // TODO contempt score
+    if (depth == 0)
+        return quiesce(ctx, alpha, beta);
+
+    TTEntry tt_entry;
+    bool tt_hit = tt_probe(get_hash(board), &tt_entry);
+    // a root entry may hold a move outside the tablebase filtered root moves
+    if (tt_hit && (tt_entry.depth >= depth) && (ply || !ctx->num_root_moves)) {
+        if (tt_entry.type == EXACT_NODE) {
+            return tt_entry.score;
+        } else if (tt_entry.type == ALL_NODE && tt_entry.score <= alpha) {
+            return alpha;
+        } else if (tt_entry.type == CUT_NODE  && tt_entry.score >= beta) {
+            return beta;
         }
     }
+    if (tt_hit && tt_entry.score > CHECKMATE_CP)
+        depth = tt_entry.depth;
 
-    if (is_in_check(board))
+    in_check = is_in_check(board);
+    if (in_check)
         depth++;
 
-    if (tt_entry)
-        reorder_moves(curr, end - curr, tt_entry->best);
-
-    Move best_move = *curr;
-
-    // HELPFUL FOR FINDING HASH COLLISIONS
-    /*Move* temp = curr;
-    bool found = false;
-    while (tt_entry && temp < end) {
-        if (tt_entry->best == *temp) {
-            found = true;
-            break;
-        }
-        temp++;
-    }
-    if (tt_entry && !found) {
-        print_move(tt_entry->best);
-        printf("\nFEN: %s\n", to_fen(board));
-        print_board(board);
-        printf("\n\n");
-        STOP_SEARCH = true;
-    }*/
+    // a colliding entry can hold any move, the picker drops it unless is_legal
+    init_picker(&mp, ctx, ply, tt_hit ? tt_entry.best : NULL_MOVE, in_check, false);
 
+    Move best_move = NULL_MOVE;
     char flag = ALL_NODE;
     int best_score = -INF;
 
-    while (curr < end) {
-        if (should_stop_search(depth)) {
+    while ((move = next_move(&mp))) {
+        if (!ply && ctx->num_root_moves && !is_root_move(ctx, move))
+            continue;
+
+        if (should_stop_search(ctx, depth)) {
             preempted = true;
             break;
         }
 
-        make_move(board, *curr);
-        int score = -alphabeta(board, -beta, -alpha, depth-1, ply+1);
-        unmake_move(board, *curr);
+        if (!moves_searched++)
+            best_move = move;
+
+        make_move(board, move);
+#if TT_PREFETCH
+        // quiescence nodes never probe the table
+        if (depth > 1)
+            tt_prefetch(get_hash(board));
+#endif
+        int score = -alphabeta(ctx, -beta, -alpha, depth-1, ply+1);
+        unmake_move(board, move);
 
         if (score > best_score) {
             best_score = score;
 
             if (score > alpha) {
                 flag = EXACT_NODE;
-                best_move = *curr;
+                best_move = move;
                 alpha = score;
             }
         }
 
         if (score >= beta) {
+            if (!is_capture(move) && !is_promotion(move))
+                update_quiet_stats(ctx, move, depth, ply);
             tt_save(get_hash(board), depth, beta, best_move, CUT_NODE);
             return beta;
         }
-        
-        curr++;
+    }
+
+    if (!moves_searched && !preempted) {
+        if (in_check) {
+            // mate
+            return -(CHECKMATE_CP + 99 - ply);
+        } else {
+            // stalemate
+            return 0; // TODO contempt score
+        }
     }
 
     if (!preempted)
@@ -269,37 +471,286 @@ int alphabeta(Board *board, int alpha, int beta, U8 depth, U8 ply) {
     return alpha;
 }
 
-void start_timer() {
-    clock_gettime(CLOCK_MONOTONIC, &START_TIME);
+void init_search_context(SearchContext *ctx, Board *board, SearchLimits limits, atomic_bool *stop) {
+    ctx->board = board;
+    ctx->nodes = 0;
+    ctx->tbhits = 0;
+    ctx->seldepth = 0;
+    ctx->root_moves = NULL;
+    ctx->num_root_moves = 0;
+    ctx->limits = limits;
+    ctx->stop = stop;
+    nnue_attach(board);
+    memset(ctx->killers, 0, sizeof(ctx->killers));
+    memset(ctx->history, 0, sizeof(ctx->history));
+}
+
+int search_root(SearchContext *ctx, U8 depth) {
+    ctx->seldepth = 0;
+    return alphabeta(ctx, -INF, INF, depth, 0);
 }
 
 U64 eval(Board *board, U8 depth) {
-    HIGHEST_DEPTH = 0;
-    alphabeta(board, -INF, INF, depth, 0);
+    SearchContext ctx;
+    atomic_bool stop = false;
+
+    init_search_context(&ctx, board, (SearchLimits){0}, &stop);
+    search_root(&ctx, depth);
     return board_hash(board);
 }
 
-int piece_eval(Board *board) {
-    int i, j, side = 0, val = 0;
-    U64 bb, color;
-    Sq pc;
-
-    for (i = 1; i >= -1; i -= 2) { // iterate over both colors
-        color = board->colors[side];
-        for (j = 0; j < NUM_PIECES; j++) { // iterate over all pieces
-            // TODO add endgame king
-            bb = board->pieces[j] & color;
-            while (bb) {
-                pc = LOG2(pop_lsb(&bb));
-                if (i == 1) // don't ask
-                    pc = flip_v(pc);
-                val += (PIECE_SQUARE_TABLE[j][pc] + PIECE_VALUES[j]) * i;
-            }
+// Only the king has a separate endgame table, every other piece uses its
+// middlegame table for both halves.
+void init_psq() {
+    int i, sq, mg, eg;
+    int eg_table;
+
+    for (i = 0; i < NUM_PIECES; i++) {
+        eg_table = i == KING_IDX ? NUM_PIECES : i;
+        for (sq = 0; sq < NUM_SQUARES; sq++) {
+            mg = PIECE_SQUARE_TABLE[i][flip_v(sq)] + PIECE_VALUES[i];
+            eg = PIECE_SQUARE_TABLE[eg_table][flip_v(sq)] + PIECE_VALUES[i];
+            PSQ[i][WHITE][sq] = MAKE_SCORE(mg, eg);
+
+            mg = PIECE_SQUARE_TABLE[i][sq] + PIECE_VALUES[i];
+            eg = PIECE_SQUARE_TABLE[eg_table][sq] + PIECE_VALUES[i];
+            PSQ[i][BLACK][sq] = -MAKE_SCORE(mg, eg);
+        }
+    }
+}
+
+// Full recompute of the balance that make_move keeps up to date.
+int board_psq(Board *board) {
+    int i, j, val = 0;
+    U64 bb;
+
+    for (i = 0; i < NUM_COLORS; i++) {
+        for (j = 0; j < NUM_PIECES; j++) {
+            bb = board->pieces[j] & board->colors[i];
+            while (bb)
+                val += PSQ[j][i][LOG2(pop_lsb(&bb))];
         }
+    }
+
+    return val;
+}
+
+int board_phase(Board *board) {
+    int i, phase = 0;
+
+    for (i = 0; i < NUM_PIECES; i++)
+        phase += POP_COUNT(board->pieces[i]) * PHASE_WEIGHTS[i];
 
-        side++;
+    return phase;
+}
+
+static inline U64 nort_fill(U64 bb) {
+    bb |= bb << 8;
+    bb |= bb << 16;
+    return bb | bb << 32;
+}
+
+static inline U64 sout_fill(U64 bb) {
+    bb |= bb >> 8;
+    bb |= bb >> 16;
+    return bb | bb >> 32;
+}
+
+// Structure of the pawns in us, seen from the side pushing them north.
+// https://www.chessprogramming.org/Pawn_Spans
+static int pawn_structure(U64 us, U64 them) {
+    U64 aux1, aux2, aux3, aux4;
+    int score = 0;
+
+    // passed: no enemy pawn ahead on the same or an adjacent file
+    aux1 = sout_fill(sout_one(them));
+    aux1 |= east_one(aux1) | west_one(aux1);
+    aux1 = us & ~aux1;
+    while (aux1)
+        score += PASSED_PAWN[LOG2(pop_lsb(&aux1)) / 8];
+
+    // isolated: no friendly pawn on an adjacent file
+    aux2 = nort_fill(sout_fill(us));
+    aux2 = us & ~(east_one(aux2) | west_one(aux2));
+    score += POP_COUNT(aux2) * ISOLATED_PAWN;
+
+    // doubled: a friendly pawn ahead on the same file
+    score += POP_COUNT(us & sout_fill(sout_one(us))) * DOUBLED_PAWN;
+
+    // backward: the stop square is attacked by an enemy pawn and no friendly
+    // pawn can ever defend it
+    aux3 = nort_fill(nort_one(east_one(us) | west_one(us)));
+    aux4 = sout_one(east_one(them) | west_one(them));
+    aux4 = sout_one(nort_one(us) & aux4 & ~aux3) & ~aux2;
+    score += POP_COUNT(aux4) * BACKWARD_PAWN;
+
+    return score;
+}
+
+// Packed pawn structure score, positive for white. Black's pawns are byte
+// swapped so both sides are evaluated pushing north.
+int pawn_eval(Board *board) {
+    U64 white = board->pieces[PAWN_IDX] & board->colors[WHITE];
+    U64 black = board->pieces[PAWN_IDX] & board->colors[BLACK];
+
+    return pawn_structure(white, black)
+        - pawn_structure(__builtin_bswap64(black), __builtin_bswap64(white));
+}
+
+static int cached_pawn_eval(Board *board) {
+    int score;
+
+    if (!pawn_tt_probe(board->pawn_key, &score)) {
+        score = pawn_eval(board);
+        pawn_tt_save(board->pawn_key, score);
     }
 
+    return score;
+}
+
+static inline int center_distance(Sq sq) {
+    return (abs(2 * (sq % 8) - 7) + abs(2 * (sq / 8) - 7)) / 2 - 1;
+}
+
+static inline int king_distance(Sq a, Sq b) {
+    return MAX(abs(a % 8 - b % 8), abs(a / 8 - b / 8));
+}
+
+static inline Sq king_sq(Board *board, bool color) {
+    return LOG2(board->pieces[KING_IDX] & board->colors[color]);
+}
+
+static inline int count(Board *board, int piece, bool color) {
+    return POP_COUNT(board->pieces[piece] & board->colors[color]);
+}
+
+static int endgame_draw(Board *board, bool strong, int val) {
+    (void)board; (void)strong; (void)val;
+    return 0;
+}
+
+// Mating material against a bare king. Drives the king to the edge and the
+// kings together, so the search finds the mate instead of shuffling.
+static int endgame_kxk(Board *board, bool strong, int val) {
+    Sq winner = king_sq(board, strong), loser = king_sq(board, !strong);
+    int i, score = KNOWN_WIN;
+
+    (void)val;
+    for (i = PAWN_IDX; i < KING_IDX; i++)
+        score += count(board, i, strong) * PIECE_VALUES[i];
+    score += 20 * center_distance(loser) + 10 * (7 - king_distance(winner, loser));
+    return strong ? -score : score;
+}
+
+// Bishop & knight against a bare king, which can only be mated in a corner of
+// the bishop's colour.
+static int endgame_kbnk(Board *board, bool strong, int val) {
+    Sq winner = king_sq(board, strong), loser = king_sq(board, !strong);
+    Sq bishop = LOG2(board->pieces[BISHOP_IDX] & board->colors[strong]);
+    bool dark = ((bishop / 8 + bishop % 8) & 1) == 0; // a1 is dark
+    int corner = dark ? MIN(king_distance(loser, 0), king_distance(loser, 63))
+                      : MIN(king_distance(loser, 7), king_distance(loser, 56));
+    int score = KNOWN_WIN + KNIGHT_CP + BISHOP_CP;
+
+    (void)val;
+    score += 40 * (7 - corner) + 10 * (7 - king_distance(winner, loser));
+    return strong ? -score : score;
+}
+
+// Bishops on opposite colours with nothing else but pawns are drawish, more so
+// when the pawn counts are close.
+static int endgame_ocb(Board *board, bool strong, int val) {
+    U64 bishops = board->pieces[BISHOP_IDX];
+    Sq a = LOG2(bishops), b = LOG2(bishops & (bishops - 1));
+    int pawn_diff = abs(count(board, PAWN_IDX, WHITE) - count(board, PAWN_IDX, BLACK));
+
+    (void)strong;
+    if (((a / 8 + a % 8) & 1) == ((b / 8 + b % 8) & 1))
+        return val;
+
+    return pawn_diff <= 1 ? val / 4 : val / 2;
+}
+
+static int endgame_kpk(Board *board, bool strong, int val) {
+    (void)strong; (void)val;
+    return kpk_score(board);
+}
+
+// indexed by MaterialEntry.endgame
+static int (*const ENDGAMES[NUM_ENDGAMES])(Board *board, bool strong, int val) = {
+    NULL, endgame_draw, endgame_kxk, endgame_kbnk, endgame_ocb, endgame_kpk
+};
+
+// Everything the evaluation derives from the piece counts alone.
+void material_eval(Board *board, MaterialEntry *entry) {
+    int npm[NUM_COLORS];
+    int color, sign, pawns, imbalance = 0;
+    bool strong;
+
+    for (color = 0; color < NUM_COLORS; color++) {
+        sign = color == WHITE ? 1 : -1;
+        pawns = count(board, PAWN_IDX, color) - 5;
+        if (count(board, BISHOP_IDX, color) >= 2)
+            imbalance += sign * BISHOP_PAIR;
+        imbalance += sign * count(board, KNIGHT_IDX, color) * pawns * KNIGHT_PER_PAWN;
+        imbalance += sign * count(board, ROOK_IDX, color) * pawns * ROOK_PER_PAWN;
+        npm[color] = count(board, KNIGHT_IDX, color) * KNIGHT_CP + count(board, BISHOP_IDX, color) * BISHOP_CP
+            + count(board, ROOK_IDX, color) * ROOK_CP + count(board, QUEEN_IDX, color) * QUEEN_CP;
+    }
+
+    entry->imbalance = imbalance;
+    entry->phase = MIN(board_phase(board), MAX_PHASE);
+    entry->endgame = ENDGAME_NONE;
+    entry->strong = WHITE;
+
+    // the side with more material is the one that can win
+    strong = npm[BLACK] + 100 * count(board, PAWN_IDX, BLACK) > npm[WHITE] + 100 * count(board, PAWN_IDX, WHITE);
+    if (npm[!strong] == 0 && !count(board, PAWN_IDX, !strong)) { // bare king
+        entry->strong = strong;
+        if (count(board, PAWN_IDX, strong)) {
+            if (npm[strong] >= ROOK_CP)
+                entry->endgame = ENDGAME_KXK;
+            else if (npm[strong] == 0 && count(board, PAWN_IDX, strong) == 1)
+                entry->endgame = ENDGAME_KPK;
+        } else if (npm[strong] <= BISHOP_CP
+                || (npm[strong] == 2 * KNIGHT_CP && count(board, KNIGHT_IDX, strong) == 2)) {
+            entry->endgame = ENDGAME_DRAW;
+        } else if (count(board, KNIGHT_IDX, strong) == 1 && count(board, BISHOP_IDX, strong) == 1
+                && npm[strong] == KNIGHT_CP + BISHOP_CP) {
+            entry->endgame = ENDGAME_KBNK;
+        } else {
+            entry->endgame = ENDGAME_KXK;
+        }
+    } else if (npm[WHITE] == BISHOP_CP && npm[BLACK] == BISHOP_CP
+            && count(board, BISHOP_IDX, WHITE) == 1 && count(board, BISHOP_IDX, BLACK) == 1) {
+        entry->endgame = ENDGAME_OCB;
+    }
+}
+
+static inline void probe_material(Board *board, MaterialEntry *entry) {
+    if (!material_tt_probe(board->material_key, entry)) {
+        material_eval(board, entry);
+        material_tt_save(board->material_key, entry);
+    }
+}
+
+// NNUE if the board carries accumulators, see nnue_attach
+int evaluate(Board *board) {
+    return board->acc ? nnue_evaluate(board) : piece_eval(board);
+}
+
+int piece_eval(Board *board) {
+    MaterialEntry material;
+    int psq, phase, val;
+
+    probe_material(board, &material);
+    psq = board->history[board->ply].psq + cached_pawn_eval(board) + material.imbalance;
+    phase = material.phase;
+    val = (mg_value(psq) * phase + eg_value(psq) * (MAX_PHASE - phase)) / MAX_PHASE;
+
+    if (material.endgame)
+        val = ENDGAMES[material.endgame](board, material.strong, val);
+
     // return the value relative to side to move (required for negamax)
-    return val * (board->side_to_move * 2 - 1)*(-1);
+    return board->side_to_move ? -val : val;
 }
@@ -8,13 +8,10 @@
 
 // TODO
 // 50 half-move rule
-// value passed pawns
-// undervalue isolated pawns
 // add pondering
 // mobility score for individual pieces
 // resrict quiescent search depth
 // write README
-// tablebases
 // iterative deepening
 // better move reording
 // endgame king piece-square table
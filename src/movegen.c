@@ -1,8 +1,61 @@
 #include "movegen.h"
 #include "utils.h"
 
+// total number of relevant-occupancy subsets over all squares
+#define ROOK_TABLE_SIZE   0x19000
+#define BISHOP_TABLE_SIZE 0x1480
+
+// Magic multipliers found by trial and error with the Carry-Rippler subset
+// enumeration described on
+// https://www.chessprogramming.org/Looking_for_Magics
+static const U64 ROOK_MAGIC_NUMBERS[NUM_SQUARES] = {
+    0x208004c004802310ULL, 0x8040002000100040ULL, 0x9100102001000840ULL, 0x0100040810002100ULL,
+    0x0100040208010010ULL, 0x8200040200080110ULL, 0x1080020001000080ULL, 0x0100030011204486ULL,
+    0x402080002a400280ULL, 0x0404400020005000ULL, 0x1060802001831000ULL, 0x0801001001002008ULL,
+    0x0109808004000800ULL, 0x0105800400120080ULL, 0xc111000200010024ULL, 0x2805801242800100ULL,
+    0x0280004000200050ULL, 0x009001c002200040ULL, 0x4290018020009180ULL, 0x2050818008013000ULL,
+    0x0009010008020410ULL, 0x0004004002010040ULL, 0x2104010100020004ULL, 0x0000020000408104ULL,
+    0x8808400680008020ULL, 0x0030200140100040ULL, 0x4004a00380100082ULL, 0x0981480280100080ULL,
+    0x0868080080040080ULL, 0x8049000900040022ULL, 0x1113a88400016210ULL, 0x0040008200050464ULL,
+    0x108012200a400040ULL, 0x0102201004400240ULL, 0x8010040020200800ULL, 0x0018801000800800ULL,
+    0x0a00800800800400ULL, 0x0002000902000410ULL, 0x802002a804002110ULL, 0x4004004082000104ULL,
+    0x0202400080628000ULL, 0xa004200c50004002ULL, 0x0110080400202002ULL, 0x10018810c2020020ULL,
+    0x8810080004008080ULL, 0x4202009084160018ULL, 0x4000229008640001ULL, 0x001020a044020001ULL,
+    0x0021020040208200ULL, 0x0050804000200080ULL, 0x8120122004410100ULL, 0x8000080090008480ULL,
+    0x0000800400080080ULL, 0x8083401020440801ULL, 0x0100100208290c00ULL, 0x0014010040ac0200ULL,
+    0x0688410010288001ULL, 0x0001400183906101ULL, 0x000100600028b441ULL, 0x8000200500100109ULL,
+    0x0041000208001005ULL, 0x022a001001040802ULL, 0x104000c108021004ULL, 0x0020040100204082ULL
+};
+
+static const U64 BISHOP_MAGIC_NUMBERS[NUM_SQUARES] = {
+    0x8002821034108080ULL, 0x0108100400504131ULL, 0x044404088208a000ULL, 0x22420a0200200080ULL,
+    0x0804042004a08a20ULL, 0x8024240440010040ULL, 0x800b1c0120490000ULL, 0x9102840080a42004ULL,
+    0x0064042154440180ULL, 0x0041141000832108ULL, 0x0d40040420860414ULL, 0x9140a20a02080004ULL,
+    0x0200111041810800ULL, 0x1014020804050020ULL, 0x0400010442024004ULL, 0x0212060082080212ULL,
+    0x0061804008012110ULL, 0x0402230802180a00ULL, 0x8001004828010210ULL, 0x001800040c208a00ULL,
+    0x00b0800405a00005ULL, 0xc402008020842012ULL, 0x8002000100900404ULL, 0x0744460a0a108400ULL,
+    0x0d08400424058802ULL, 0x40480211050c082eULL, 0x0080208090008080ULL, 0x0010104004040002ULL,
+    0x5101010004104004ULL, 0x00008202e1004201ULL, 0x0448030c0841380cULL, 0x2211004022021084ULL,
+    0x0004224800212000ULL, 0x220202100420a108ULL, 0x0603040110020802ULL, 0x5408840108140101ULL,
+    0x0020440401004100ULL, 0x0010102080004040ULL, 0x2008810042140a00ULL, 0x1002421020420080ULL,
+    0x8408421a203810d0ULL, 0x026418a410000420ULL, 0x0000202030000800ULL, 0x2011012011000800ULL,
+    0x8480200414001642ULL, 0x0e40010040800900ULL, 0x08a0284240488080ULL, 0x1004011042000900ULL,
+    0x1001011002a20002ULL, 0xa202020104225082ULL, 0x0000002201100000ULL, 0x0000450020880060ULL,
+    0x000400c005010040ULL, 0x1820400304290400ULL, 0x0912241004aa0400ULL, 0x0002080801044d20ULL,
+    0x8c00402218200400ULL, 0x9000210101012000ULL, 0x0201800104010440ULL, 0x0006000088420880ULL,
+    0x0081050020120490ULL, 0x0000000802a80200ULL, 0x3800401101091100ULL, 0x8008020802140010ULL
+};
+
 static U64 N_MOVE_TABLE[NUM_SQUARES];
 static U64 K_MOVE_TABLE[NUM_SQUARES];
+static U64 ROOK_TABLE[ROOK_TABLE_SIZE];
+static U64 BISHOP_TABLE[BISHOP_TABLE_SIZE];
+Magic ROOK_MAGICS[NUM_SQUARES];
+Magic BISHOP_MAGICS[NUM_SQUARES];
+int SLIDER_BACKEND = SLIDER_MAGIC;
+
+U64 BETWEEN[NUM_SQUARES][NUM_SQUARES];
+U64 LINE[NUM_SQUARES][NUM_SQUARES];
 
 static U64 n_moves_slow(U64 orig) {
     // source
@@ -48,6 +101,111 @@ static U64 sliding_attacks(U64 orig, U64 blocks, const int dxes[], const int dye
     return attacks;
 }
 
+static U64 r_moves_slow(U64 orig, U64 blocks) {
+    const int dxes[4] = { 0,  1,  0, -1 };
+    const int dyes[4] = { 1,  0, -1,  0 };
+
+    return sliding_attacks(orig, blocks, dxes, dyes, 4);
+}
+
+static U64 b_moves_slow(U64 orig, U64 blocks) {
+    const int dxes[4] = { 1, -1,  1, -1 };
+    const int dyes[4] = { 1,  1, -1, -1 };
+
+    return sliding_attacks(orig, blocks, dxes, dyes, 4);
+}
+
+// Relevant occupancy of a slider on a square: every square it could reach on
+// an empty board, minus the final square of each ray (a piece there can never
+// block anything further along).
+static U64 relevant_mask(Sq sq, bool is_rook) {
+    U64 orig = 1ULL << sq;
+    U64 edges = ((RANK_1 | RANK_8) & ~(RANK_1 << (sq / 8 * 8)))
+              | ((A_FILE | H_FILE) & ~(A_FILE << (sq % 8)));
+
+    if (is_rook)
+        return r_moves_slow(orig, 0ULL) & ~edges;
+
+    return b_moves_slow(orig, 0ULL) & ~edges;
+}
+
+// Fills the attack table of a single square by enumerating every subset of
+// its relevant mask with the Carry-Rippler trick. The order of the entries
+// depends on the indexing scheme of the chosen backend.
+static void init_magic(Magic *m, Sq sq, bool is_rook, U64 *table, int backend) {
+    U64 b = 0ULL, idx, orig = 1ULL << sq;
+
+    m->mask = relevant_mask(sq, is_rook);
+    m->magic = is_rook ? ROOK_MAGIC_NUMBERS[sq] : BISHOP_MAGIC_NUMBERS[sq];
+    m->shift = 64 - POP_COUNT(m->mask);
+    m->attacks = table;
+
+    do {
+#ifdef HAS_PEXT_BACKEND
+        if (backend == SLIDER_PEXT)
+            idx = pext(b, m->mask);
+        else
+#endif
+            idx = (b * m->magic) >> m->shift;
+        table[idx] = is_rook ? r_moves_slow(orig, b) : b_moves_slow(orig, b);
+        b = (b - m->mask) & m->mask;
+    } while (b);
+}
+
+int best_slider_backend() {
+#ifdef HAS_PEXT_BACKEND
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("bmi2"))
+        return SLIDER_PEXT;
+#endif
+
+    return SLIDER_MAGIC;
+}
+
+int set_slider_backend(int backend) {
+    U64 *rook_table = ROOK_TABLE;
+    U64 *bishop_table = BISHOP_TABLE;
+    int i;
+
+    if (backend == SLIDER_PEXT && best_slider_backend() != SLIDER_PEXT)
+        backend = SLIDER_MAGIC;
+
+    for (i = 0; i < NUM_SQUARES; i++) {
+        init_magic(&ROOK_MAGICS[i], i, true, rook_table, backend);
+        rook_table += 1ULL << (64 - ROOK_MAGICS[i].shift);
+        init_magic(&BISHOP_MAGICS[i], i, false, bishop_table, backend);
+        bishop_table += 1ULL << (64 - BISHOP_MAGICS[i].shift);
+    }
+
+    return SLIDER_BACKEND = backend;
+}
+
+const char* slider_backend_name() {
+    return SLIDER_BACKEND == SLIDER_PEXT ? "pext" : "magic";
+}
+
+static void init_line_tables() {
+    U64 a, b;
+    int i, j;
+
+    for (i = 0; i < NUM_SQUARES; i++) {
+        for (j = 0; j < NUM_SQUARES; j++) {
+            a = 1ULL << i;
+            b = 1ULL << j;
+            BETWEEN[i][j] = 0ULL;
+            LINE[i][j] = 0ULL;
+
+            if (r_moves_slow(a, 0ULL) & b) {
+                BETWEEN[i][j] = r_moves_slow(a, b) & r_moves_slow(b, a);
+                LINE[i][j] = (r_moves_slow(a, 0ULL) & r_moves_slow(b, 0ULL)) | a | b;
+            } else if (b_moves_slow(a, 0ULL) & b) {
+                BETWEEN[i][j] = b_moves_slow(a, b) & b_moves_slow(b, a);
+                LINE[i][j] = (b_moves_slow(a, 0ULL) & b_moves_slow(b, 0ULL)) | a | b;
+            }
+        }
+    }
+}
+
 void init_move_lookup_tables() {
     int i = 0;
 
@@ -56,6 +214,10 @@ void init_move_lookup_tables() {
         N_MOVE_TABLE[i] = n_moves_slow(bb);
         K_MOVE_TABLE[i] = k_moves_slow(bb);
     }
+
+    init_line_tables();
+
+    set_slider_backend(best_slider_backend());
 }
 
 U64 n_moves(U64 orig) {
@@ -66,34 +228,10 @@ U64 k_moves(U64 orig) {
     return K_MOVE_TABLE[LOG2(orig)];
 }
 
-U64 r_moves(U64 orig, U64 blocks) {
-    const int dxes[4] = { 0,  1,  0, -1 };
-    const int dyes[4] = { 1,  0, -1,  0 };
-
-    return sliding_attacks(orig, blocks, dxes, dyes, 4);
-}
-
-U64 b_moves(U64 orig, U64 blocks) {
-    const int dxes[4] = { 1, -1,  1, -1 };
-    const int dyes[4] = { 1,  1, -1, -1 };
-
-    return sliding_attacks(orig, blocks, dxes, dyes, 4);
-}
-
 U64 h_moves(U64 orig, U64 blocks) {
-    const int dxes[4] = { 0,  1 };
-    const int dyes[4] = { 0, -1 };
-
-    return sliding_attacks(orig, blocks, dxes, dyes, 2);
+    return r_moves(orig, blocks) & (RANK_1 << (LOG2(orig) / 8 * 8));
 }
 
 U64 v_moves(U64 orig, U64 blocks) {
-    const int dxes[2] = { 0,  0 };
-    const int dyes[2] = { 1, -1 };
-
-    return sliding_attacks(orig, blocks, dxes, dyes, 2);
-}
-
-U64 q_moves(U64 orig, U64 blocks) {
-    return r_moves(orig, blocks) | b_moves(orig, blocks);
+    return r_moves(orig, blocks) & (A_FILE << (LOG2(orig) % 8));
 }
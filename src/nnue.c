@@ -0,0 +1,379 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "nnue.h"
+#include "utils.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAS_AVX2_BACKEND 1
+#endif
+
+#define NNUE_FILE_MAGIC 0x45554e4e4e5a4e4dULL // "MNZNNNUE"
+#define NNUE_FILE_VERSION 1
+#define MAX_ACTIVE_FEATURES 32
+#define MAX_DIRTY_FEATURES 2
+
+/*
+ * Network file, little endian. The header is followed by
+ *
+ *   int16 ft_weights[NNUE_INPUTS][NNUE_HIDDEN]
+ *   int16 ft_bias[NNUE_HIDDEN]
+ *   int16 out_weights[2 * NNUE_HIDDEN]  side to move half first
+ *   int32 out_bias
+ *
+ * The file is mapped read-only and the weights are used in place.
+ */
+typedef struct {
+    U64 magic;
+    U32 version;
+    U32 inputs;
+    U32 hidden;
+    U32 reserved[3];
+} NNUEFileHeader;
+
+typedef struct {
+    const int16_t *ft_weights;
+    const int16_t *ft_bias;
+    const int16_t *out_weights;
+    int32_t out_bias;
+    void   *data;
+    size_t  size;
+    bool    mapped; // data is an mmap of the network file, else malloc'd
+} Network;
+
+static Network NET = {0};
+static int NNUE_BACKEND = NNUE_SCALAR;
+
+static void update_scalar(int16_t *dst, const int16_t *src, const int *add, int num_add, const int *sub, int num_sub);
+static int output_scalar(const int16_t *us, const int16_t *them);
+static void (*update_accumulator)(int16_t *dst, const int16_t *src, const int *add, int num_add, const int *sub, int num_sub) = update_scalar;
+static int (*propagate)(const int16_t *us, const int16_t *them) = output_scalar;
+
+static inline int feature(bool perspective, int piece, bool color, int sq) {
+    return ((color != perspective) * NUM_PIECES + piece) * NUM_SQUARES + (perspective ? sq ^ 56 : sq);
+}
+
+static void update_scalar(int16_t *dst, const int16_t *src, const int *add, int num_add, const int *sub, int num_sub) {
+    int i, j;
+
+    memcpy(dst, src, NNUE_HIDDEN * sizeof(int16_t));
+    for (j = 0; j < num_add; j++) {
+        const int16_t *w = NET.ft_weights + add[j] * NNUE_HIDDEN;
+        for (i = 0; i < NNUE_HIDDEN; i++)
+            dst[i] += w[i];
+    }
+    for (j = 0; j < num_sub; j++) {
+        const int16_t *w = NET.ft_weights + sub[j] * NNUE_HIDDEN;
+        for (i = 0; i < NNUE_HIDDEN; i++)
+            dst[i] -= w[i];
+    }
+}
+
+// clipped ReLU of both halves dotted with the output weights
+static int output_scalar(const int16_t *us, const int16_t *them) {
+    const int16_t *w = NET.out_weights;
+    int i, sum = 0;
+
+    for (i = 0; i < NNUE_HIDDEN; i++) {
+        sum += MIN(MAX(us[i], 0), NNUE_QA) * w[i];
+        sum += MIN(MAX(them[i], 0), NNUE_QA) * w[NNUE_HIDDEN + i];
+    }
+
+    return sum;
+}
+
+#ifdef HAS_AVX2_BACKEND
+#define AVX2_CHUNK 64 // int16 lanes kept in registers per pass, 4 ymm
+
+__attribute__((target("avx2")))
+static void update_avx2(int16_t *dst, const int16_t *src, const int *add, int num_add, const int *sub, int num_sub) {
+    __m256i regs[AVX2_CHUNK / 16];
+    int i, j, k;
+
+    for (i = 0; i < NNUE_HIDDEN; i += AVX2_CHUNK) {
+        for (k = 0; k < AVX2_CHUNK / 16; k++)
+            regs[k] = _mm256_loadu_si256((const __m256i*)(src + i + k * 16));
+        for (j = 0; j < num_add; j++) {
+            const int16_t *w = NET.ft_weights + add[j] * NNUE_HIDDEN + i;
+            for (k = 0; k < AVX2_CHUNK / 16; k++)
+                regs[k] = _mm256_add_epi16(regs[k], _mm256_loadu_si256((const __m256i*)(w + k * 16)));
+        }
+        for (j = 0; j < num_sub; j++) {
+            const int16_t *w = NET.ft_weights + sub[j] * NNUE_HIDDEN + i;
+            for (k = 0; k < AVX2_CHUNK / 16; k++)
+                regs[k] = _mm256_sub_epi16(regs[k], _mm256_loadu_si256((const __m256i*)(w + k * 16)));
+        }
+        for (k = 0; k < AVX2_CHUNK / 16; k++)
+            _mm256_store_si256((__m256i*)(dst + i + k * 16), regs[k]);
+    }
+}
+
+__attribute__((target("avx2")))
+static int output_avx2(const int16_t *us, const int16_t *them) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ceil = _mm256_set1_epi16(NNUE_QA);
+    const int16_t *w = NET.out_weights;
+    __m256i sum = zero, v;
+    __m128i half;
+    int i;
+
+    // madd_epi16 multiplies the int16 lanes and adds neighbouring products
+    // into int32 lanes, which cannot overflow as activations are <= NNUE_QA
+    for (i = 0; i < NNUE_HIDDEN; i += 16) {
+        v = _mm256_min_epi16(_mm256_max_epi16(_mm256_load_si256((const __m256i*)(us + i)), zero), ceil);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(v, _mm256_loadu_si256((const __m256i*)(w + i))));
+        v = _mm256_min_epi16(_mm256_max_epi16(_mm256_load_si256((const __m256i*)(them + i)), zero), ceil);
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(v, _mm256_loadu_si256((const __m256i*)(w + NNUE_HIDDEN + i))));
+    }
+
+    half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));
+    return _mm_cvtsi128_si32(half);
+}
+#endif
+
+int best_nnue_backend() {
+#ifdef HAS_AVX2_BACKEND
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return NNUE_AVX2;
+#endif
+
+    return NNUE_SCALAR;
+}
+
+int set_nnue_backend(int backend) {
+    if (backend == NNUE_AVX2 && best_nnue_backend() != NNUE_AVX2)
+        backend = NNUE_SCALAR;
+
+    update_accumulator = update_scalar;
+    propagate = output_scalar;
+#ifdef HAS_AVX2_BACKEND
+    if (backend == NNUE_AVX2) {
+        update_accumulator = update_avx2;
+        propagate = output_avx2;
+    }
+#endif
+
+    return NNUE_BACKEND = backend;
+}
+
+const char* nnue_backend_name() {
+    return NNUE_BACKEND == NNUE_AVX2 ? "avx2" : "scalar";
+}
+
+void nnue_unload() {
+    if (NET.mapped)
+        munmap(NET.data, NET.size);
+    else
+        free(NET.data);
+
+    memset(&NET, 0, sizeof(Network));
+}
+
+bool nnue_enabled() {
+    return NET.data != NULL;
+}
+
+static void set_network(void *data, size_t size, bool mapped) {
+    const int16_t *weights = (const int16_t*)((char*)data + sizeof(NNUEFileHeader));
+
+    nnue_unload();
+    NET.data = data;
+    NET.size = size;
+    NET.mapped = mapped;
+    NET.ft_weights = weights;
+    NET.ft_bias = NET.ft_weights + NNUE_INPUTS * NNUE_HIDDEN;
+    NET.out_weights = NET.ft_bias + NNUE_HIDDEN;
+    memcpy(&NET.out_bias, NET.out_weights + 2 * NNUE_HIDDEN, sizeof(int32_t));
+    set_nnue_backend(best_nnue_backend());
+}
+
+static size_t network_file_size() {
+    return sizeof(NNUEFileHeader)
+        + (NNUE_INPUTS * NNUE_HIDDEN + NNUE_HIDDEN + 2 * NNUE_HIDDEN) * sizeof(int16_t)
+        + sizeof(int32_t);
+}
+
+// Maps a network file. The currently loaded network is kept on failure.
+bool nnue_load(const char *path) {
+    NNUEFileHeader *header;
+    struct stat st;
+    void *mem;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Error opening network file %s.\n", path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    if ((size_t)st.st_size != network_file_size()) {
+        fprintf(stderr, "Rejecting network file %s of size %ld, expected %lu.\n",
+                path, (long)st.st_size, network_file_size());
+        close(fd);
+        return false;
+    }
+
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "Error mapping network file %s.\n", path);
+        return false;
+    }
+
+    header = (NNUEFileHeader*)mem;
+    if (header->magic != NNUE_FILE_MAGIC || header->version != NNUE_FILE_VERSION
+            || header->inputs != NNUE_INPUTS || header->hidden != NNUE_HIDDEN) {
+        fprintf(stderr, "Rejecting network file %s with an unknown layout.\n", path);
+        munmap(mem, st.st_size);
+        return false;
+    }
+
+    set_network(mem, st.st_size, true);
+    return true;
+}
+
+// Untrained network with small random weights, for benchmarks & tests when no
+// network file is at hand.
+void nnue_init_random(U64 seed) {
+    size_t size = network_file_size();
+    char *mem = malloc(size);
+    int16_t *weights;
+    size_t i, n = (size - sizeof(NNUEFileHeader) - sizeof(int32_t)) / sizeof(int16_t);
+    int32_t bias = 0;
+
+    if (mem == NULL) {
+        fprintf(stderr, "Error allocating network of size %lu.\nExiting...", size);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(mem, 0, sizeof(NNUEFileHeader));
+    weights = (int16_t*)(mem + sizeof(NNUEFileHeader));
+    for (i = 0; i < n; i++) {
+        seed ^= seed << 13; // xorshift64
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        weights[i] = (int16_t)(seed % 129) - 64;
+    }
+    memcpy(weights + n, &bias, sizeof(int32_t));
+
+    set_network(mem, size, false);
+}
+
+void nnue_refresh(Board *board, Accumulator *acc) {
+    int features[MAX_ACTIVE_FEATURES];
+    int perspective, color, piece, n;
+    U64 bb;
+
+    for (perspective = 0; perspective < NUM_COLORS; perspective++) {
+        n = 0;
+        for (color = 0; color < NUM_COLORS; color++) {
+            for (piece = 0; piece < NUM_PIECES; piece++) {
+                bb = board->pieces[piece] & board->colors[color];
+                while (bb && n < MAX_ACTIVE_FEATURES)
+                    features[n++] = feature(perspective, piece, color, LOG2(pop_lsb(&bb)));
+            }
+        }
+
+        update_accumulator(acc->values[perspective], NET.ft_bias, features, n, NULL, 0);
+    }
+}
+
+// Gives the board its own accumulator stack, refreshed at the current ply.
+// Boards are left without one, and evaluated classically, if no network is
+// loaded.
+void nnue_attach(Board *board) {
+    if (!nnue_enabled()) {
+        nnue_detach(board);
+        return;
+    }
+
+    if (board->acc_stack == NULL) {
+        board->acc_stack = aligned_alloc(CACHE_LINE, (MAX_SEARCH_PLY + 1) * sizeof(Accumulator));
+        if (board->acc_stack == NULL) {
+            fprintf(stderr, "Error allocating accumulator stack.\nExiting...");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    board->acc = board->acc_stack;
+    nnue_refresh(board, board->acc);
+}
+
+void nnue_detach(Board *board) {
+    free(board->acc_stack);
+    board->acc_stack = NULL;
+    board->acc = NULL;
+}
+
+// Called by make_move once the move is on the board. Fills the next
+// accumulator from the pieces the move added & removed.
+void nnue_push(Board *board, Move move) {
+    int add[NUM_COLORS][MAX_DIRTY_FEATURES], sub[NUM_COLORS][MAX_DIRTY_FEATURES];
+    int num_add = 0, num_sub = 0;
+    int pieces_add[MAX_DIRTY_FEATURES], sqs_add[MAX_DIRTY_FEATURES];
+    int pieces_sub[MAX_DIRTY_FEATURES], sqs_sub[MAX_DIRTY_FEATURES];
+    bool colors_sub[MAX_DIRTY_FEATURES];
+    bool us = !board->side_to_move;
+    int from = get_from(move), to = get_to(move);
+    int rank = us ? 56 : 0;
+    int perspective, i;
+    Accumulator *prev = board->acc++;
+
+    debug_assert(board->acc - board->acc_stack <= MAX_SEARCH_PLY, "accumulator stack overflow");
+
+    if (((move >> 12) & 0b1110) == 0b10) { // castle
+        bool is_long = (move >> 12) & 1;
+        pieces_sub[0] = KING_IDX; sqs_sub[0] = rank + 4; colors_sub[0] = us;
+        pieces_sub[1] = ROOK_IDX; sqs_sub[1] = rank + (is_long ? 0 : 7); colors_sub[1] = us;
+        pieces_add[0] = KING_IDX; sqs_add[0] = rank + (is_long ? 2 : 6);
+        pieces_add[1] = ROOK_IDX; sqs_add[1] = rank + (is_long ? 3 : 5);
+        num_add = num_sub = 2;
+    } else {
+        pieces_sub[0] = (move & 0x8000) ? PAWN_IDX : board->squares[to];
+        sqs_sub[0] = from;
+        colors_sub[0] = us;
+        pieces_add[0] = board->squares[to];
+        sqs_add[0] = to;
+        num_add = num_sub = 1;
+
+        if (move >> 12 == 5) { // ep capture
+            pieces_sub[1] = PAWN_IDX;
+            sqs_sub[1] = us ? to + 8 : to - 8;
+            colors_sub[1] = !us;
+            num_sub = 2;
+        } else if (move & 0x4000) { // capture
+            pieces_sub[1] = (board->history[board->ply].state >> 17) & 0x07;
+            sqs_sub[1] = to;
+            colors_sub[1] = !us;
+            num_sub = 2;
+        }
+    }
+
+    for (perspective = 0; perspective < NUM_COLORS; perspective++) {
+        for (i = 0; i < num_add; i++)
+            add[perspective][i] = feature(perspective, pieces_add[i], us, sqs_add[i]);
+        for (i = 0; i < num_sub; i++)
+            sub[perspective][i] = feature(perspective, pieces_sub[i], colors_sub[i], sqs_sub[i]);
+
+        update_accumulator(board->acc->values[perspective], prev->values[perspective],
+                add[perspective], num_add, sub[perspective], num_sub);
+    }
+}
+
+// relative to side to move, like piece_eval
+int nnue_evaluate(Board *board) {
+    Accumulator *acc = board->acc;
+    bool stm = board->side_to_move;
+    int sum = propagate(acc->values[stm], acc->values[!stm]);
+
+    return (sum + NET.out_bias) * NNUE_SCALE / (NNUE_QA * NNUE_QB);
+}
@@ -0,0 +1,1107 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "movegen.h"
+#include "syzygy.h"
+#include "table.h"
+#include "utils.h"
+
+#define TB_MAX_TABLES 1024
+#define TB_HASH_SIZE  4096 // two keys per table, a power of two
+
+// outcome of a single probe
+#define PROBE_FAIL       0
+#define PROBE_OK         1
+#define PROBE_CHANGE_STM 2 // the DTZ table only stores the other side to move
+#define PROBE_ZEROING    3 // the best move is a capture or a pawn move
+
+// per-block flags, all but the last only appear in DTZ tables
+#define TB_FLAG_STM        1
+#define TB_FLAG_MAPPED     2
+#define TB_FLAG_WIN_PLIES  4
+#define TB_FLAG_LOSS_PLIES 8
+#define TB_FLAG_WIDE       16
+#define TB_FLAG_SINGLE     128
+
+static const U8 WDL_MAGIC[4] = { 0x71, 0xe8, 0x23, 0x5d };
+static const U8 DTZ_MAGIC[4] = { 0xd7, 0x66, 0x0c, 0xa5 };
+
+/*
+ * Decoding state of one block of a table file. Values are Huffman coded
+ * symbols, and a symbol expands recursively into a pair of symbols until it
+ * reaches a single value. Everything but base64 & symlen points into the
+ * mapped file.
+ *
+ * lowest_sym    lowest symbol of each code length, little endian
+ * btree         12-bit left & right children of each symbol
+ * block_length  values in each block minus one
+ * sparse_index  block & offset of every span-th value, 6 bytes each
+ * base64        lowest code of each length, left aligned to 64 bits
+ * symlen        values a symbol expands to minus one
+ * pieces        piece codes in the order the position is indexed
+ * group_idx     multiplier of each group of pieces in the index
+ * group_len     pieces per group, zero terminated
+ */
+typedef struct {
+    U8  flags;
+    U8  max_sym_len;
+    U8  min_sym_len; // the stored value of a single valued table
+    U32 num_blocks;
+    U64 block_size;
+    U64 span;
+    U8  *lowest_sym;
+    U8  *btree;
+    U8  *block_length;
+    U32 block_length_size;
+    U8  *sparse_index;
+    U64 sparse_index_size;
+    U8  *data;
+    U64 *base64;
+    U8  *symlen;
+    U8  pieces[TB_PIECES];
+    U64 group_idx[TB_PIECES + 1];
+    int group_len[TB_PIECES + 1];
+    U16 map_idx[4]; // DTZ value maps of WIN, LOSS, CURSED_WIN & BLESSED_LOSS
+} PairsData;
+
+/*
+ * One .rtbw or .rtbz file. Tables are registered when their file is found
+ * and mapped on first probe. key has the first side of the name as white,
+ * key2 as black. Pawnful tables are split by the file of the leading pawn,
+ * WDL tables by side to move unless both sides hold the same pieces.
+ */
+typedef struct {
+    char name[TB_PIECES + 2]; // like KRvKP
+    bool dtz;
+    atomic_bool ready;
+    void *base; // NULL if the file is missing or corrupted
+    size_t size;
+    U8 *map; // DTZ value maps
+    U64 key;
+    U64 key2;
+    int piece_count;
+    bool has_pawns;
+    bool has_unique_pieces;
+    U8 pawn_count[NUM_COLORS]; // leading side first
+    PairsData items[NUM_COLORS][4];
+} TBTable;
+
+int TB_LARGEST = 0;
+
+static char *TB_PATHS = NULL;
+static TBTable *WDL_TABLES = NULL;
+static TBTable *DTZ_TABLES = NULL;
+static int NUM_TABLES = 0;
+static int TB_HASH[TB_HASH_SIZE]; // table index + 1 of each material key
+static U64 TB_HASH_KEYS[TB_HASH_SIZE];
+static pthread_mutex_t TB_MAP_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// index encoding, see init_tb_index
+static bool TB_INDEX_READY = false;
+static int MAP_PAWNS[NUM_SQUARES];
+static int MAP_B1H1H7[NUM_SQUARES];
+static int MAP_A1D1D4[NUM_SQUARES];
+static int MAP_KK[10][NUM_SQUARES];
+static U64 BINOMIAL[TB_PIECES][NUM_SQUARES];
+static int LEAD_PAWN_IDX[TB_PIECES][NUM_SQUARES];
+static int LEAD_PAWNS_SIZE[TB_PIECES][4];
+
+static inline U16 read_le16(const U8 *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline U32 read_le32(const U8 *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((U32)p[3] << 24);
+}
+
+static inline U32 read_be32(const U8 *p) {
+    return ((U32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline U64 read_be64(const U8 *p) {
+    return ((U64)read_be32(p) << 32) | read_be32(p + 4);
+}
+
+// positive above the a1-h8 diagonal, negative below
+static inline int off_diagonal(Sq sq) {
+    return (int)(sq / 8) - (int)(sq % 8);
+}
+
+static inline PairsData* table_data(TBTable *e, int stm, int file) {
+    return &e->items[e->dtz ? 0 : stm][e->has_pawns ? file : 0];
+}
+
+static inline int btree_left(PairsData *d, int sym) {
+    U8 *lr = d->btree + 3 * sym;
+    return ((lr[1] & 0xf) << 8) | lr[0];
+}
+
+static inline int btree_right(PairsData *d, int sym) {
+    U8 *lr = d->btree + 3 * sym;
+    return (lr[2] << 4) | (lr[1] >> 4);
+}
+
+// DTZ of the move before a capture or pawn move, which the DTZ tables leave out
+static int dtz_before_zeroing(int wdl) {
+    return wdl == TB_WIN ? 1 : wdl == TB_CURSED_WIN ? 101
+        : wdl == TB_BLESSED_LOSS ? -101 : wdl == TB_LOSS ? -1 : 0;
+}
+
+static inline int sign(int x) {
+    return (x > 0) - (x < 0);
+}
+
+/*
+ * Squares are mirrored so the leading piece is in the a1-d1-d4 triangle, or
+ * the leading pawn on files a-d. The tables below number what is left of the
+ * board after mirroring, as the generator does.
+ */
+static void init_tb_index() {
+    static const Sq TRIANGLE[] = { 0, 1, 2, 3, 8, 9, 10, 11, 16, 17, 18, 19, 24, 25, 26, 27 };
+    Sq diagonal[4], s1, s2;
+    int both_idx[64], both_sq[64];
+    int i, k, n, f, r, idx, code, num_diagonal = 0, num_both = 0;
+    int available = 47; // squares left for the other pawns when the leader is on a2
+
+    code = 0;
+    for (s1 = 0; s1 < NUM_SQUARES; s1++) {
+        if (off_diagonal(s1) < 0)
+            MAP_B1H1H7[s1] = code++;
+    }
+
+    code = 0;
+    for (i = 0; i < 16; i++) {
+        if (off_diagonal(TRIANGLE[i]) < 0)
+            MAP_A1D1D4[TRIANGLE[i]] = code++;
+        else if (!off_diagonal(TRIANGLE[i]))
+            diagonal[num_diagonal++] = TRIANGLE[i];
+    }
+    for (i = 0; i < num_diagonal; i++)
+        MAP_A1D1D4[diagonal[i]] = code++;
+
+    // the 462 king pairs with the first king in the triangle, both kings on
+    // the diagonal numbered last
+    code = 0;
+    for (idx = 0; idx < 10; idx++) {
+        for (s1 = 0; s1 <= 27; s1++) {
+            if (MAP_A1D1D4[s1] != idx || (!idx && s1 != 1)) // b1 is mapped to 0
+                continue;
+
+            for (s2 = 0; s2 < NUM_SQUARES; s2++) {
+                if ((k_moves(1ULL << s1) | (1ULL << s1)) & (1ULL << s2))
+                    continue;
+                else if (!off_diagonal(s1) && off_diagonal(s2) > 0)
+                    continue;
+                else if (!off_diagonal(s1) && !off_diagonal(s2)) {
+                    both_idx[num_both] = idx;
+                    both_sq[num_both++] = s2;
+                } else {
+                    MAP_KK[idx][s2] = code++;
+                }
+            }
+        }
+    }
+    for (i = 0; i < num_both; i++)
+        MAP_KK[both_idx[i]][both_sq[i]] = code++;
+
+    BINOMIAL[0][0] = 1;
+    for (n = 1; n < NUM_SQUARES; n++) {
+        for (k = 0; k < TB_PIECES && k <= n; k++)
+            BINOMIAL[k][n] = (k > 0 ? BINOMIAL[k - 1][n - 1] : 0) + (k < n ? BINOMIAL[k][n - 1] : 0);
+    }
+
+    // pawns closest to the edge and lowest get the highest number, the pawn
+    // with the highest number leads
+    for (k = 1; k < TB_PIECES; k++) {
+        for (f = 0; f < 4; f++) {
+            idx = 0;
+            for (r = 1; r <= 6; r++) {
+                Sq sq = r * 8 + f;
+                if (k == 1) {
+                    MAP_PAWNS[sq] = available--;
+                    MAP_PAWNS[sq ^ 7] = available--;
+                }
+                LEAD_PAWN_IDX[k][sq] = idx;
+                idx += BINOMIAL[k - 1][MAP_PAWNS[sq]];
+            }
+            LEAD_PAWNS_SIZE[k][f] = idx;
+        }
+    }
+
+    TB_INDEX_READY = true;
+}
+
+/*
+ * Finds the value at index idx. The sparse index points near the right
+ * block, then symbols are read until the one covering idx, which is
+ * expanded down to a single value.
+ */
+static int decompress_pairs(PairsData *d, U64 idx) {
+    U32 k, block;
+    int offset, len, buf64_size = 64;
+    U64 buf64;
+    U16 sym, left;
+    U8 *ptr;
+
+    if (d->flags & TB_FLAG_SINGLE)
+        return d->min_sym_len;
+
+    k = idx / d->span;
+    block = read_le32(d->sparse_index + 6 * k);
+    offset = read_le16(d->sparse_index + 6 * k + 4);
+    offset += (int)(idx % d->span) - (int)(d->span / 2);
+
+    while (offset < 0)
+        offset += read_le16(d->block_length + 2 * --block) + 1;
+    while (offset > read_le16(d->block_length + 2 * block))
+        offset -= read_le16(d->block_length + 2 * block++) + 1;
+
+    ptr = d->data + (U64)block * d->block_size;
+    buf64 = read_be64(ptr);
+    ptr += 8;
+
+    while (1) {
+        // longer codes have lower values, the first base below buf64 gives
+        // the length
+        len = 0;
+        while (buf64 < d->base64[len])
+            len++;
+
+        sym = (buf64 - d->base64[len]) >> (64 - len - d->min_sym_len);
+        sym += read_le16(d->lowest_sym + 2 * len);
+
+        if (offset < d->symlen[sym] + 1)
+            break;
+
+        offset -= d->symlen[sym] + 1;
+        len += d->min_sym_len;
+        buf64 <<= len;
+        buf64_size -= len;
+
+        if (buf64_size <= 32) {
+            buf64_size += 32;
+            buf64 |= (U64)read_be32(ptr) << (64 - buf64_size);
+            ptr += 4;
+        }
+    }
+
+    while (d->symlen[sym]) {
+        left = btree_left(d, sym);
+        if (offset < d->symlen[left] + 1) {
+            sym = left;
+        } else {
+            offset -= d->symlen[left] + 1;
+            sym = btree_right(d, sym);
+        }
+    }
+
+    return btree_left(d, sym);
+}
+
+/*
+ * Index of the position in the table. Colours are swapped when black holds
+ * the first side of the name, the board is mirrored onto the part the table
+ * covers, then each group of pieces is numbered by combination.
+ */
+static int probe_table(Board *board, bool dtz, int wdl, int *result);
+
+static int do_probe_table(Board *board, TBTable *e, int wdl, int *result) {
+    Sq squares[TB_PIECES], tmp_sq, *group_sq;
+    U8 pieces[TB_PIECES], tmp_pc;
+    U64 aux1, lead_pawns = 0, idx, n;
+    int i, j, next = 0, size = 0, lead_pawns_cnt = 0, tb_file = 0, value;
+    bool flip = (e->key == e->key2 && board->side_to_move) || board->material_key != e->key;
+    int flip_color = flip * 8, flip_squares = flip * 56, stm = flip ^ board->side_to_move;
+    bool remaining_pawns;
+    PairsData *d;
+
+    if (e->has_pawns) {
+        // pawns of the leading side come first in every pawnful table
+        U8 pc = table_data(e, 0, 0)->pieces[0] ^ flip_color;
+
+        lead_pawns = aux1 = board->pieces[PAWN_IDX] & board->colors[pc >> 3];
+        while (aux1)
+            squares[size++] = LOG2(pop_lsb(&aux1)) ^ flip_squares;
+        lead_pawns_cnt = size;
+
+        for (i = 1, j = 0; i < lead_pawns_cnt; i++) {
+            if (MAP_PAWNS[squares[i]] > MAP_PAWNS[squares[j]])
+                j = i;
+        }
+        tmp_sq = squares[0], squares[0] = squares[j], squares[j] = tmp_sq;
+
+        tb_file = squares[0] % 8 > 3 ? 7 - squares[0] % 8 : squares[0] % 8;
+    }
+
+    if (e->dtz && (table_data(e, stm, tb_file)->flags & TB_FLAG_STM) != stm
+            && (e->key != e->key2 || e->has_pawns)) {
+        *result = PROBE_CHANGE_STM;
+        return 0;
+    }
+
+    aux1 = (board->colors[WHITE] | board->colors[BLACK]) ^ lead_pawns;
+    while (aux1) {
+        Sq sq = LOG2(pop_lsb(&aux1));
+        squares[size] = sq ^ flip_squares;
+        pieces[size++] = (board->squares[sq] + 1 + 8 * ((board->colors[BLACK] >> sq) & 1)) ^ flip_color;
+    }
+
+    d = table_data(e, stm, tb_file);
+
+    // same piece order as the table
+    for (i = lead_pawns_cnt; i < size - 1; i++) {
+        for (j = i + 1; j < size; j++) {
+            if (d->pieces[i] == pieces[j]) {
+                tmp_pc = pieces[i], pieces[i] = pieces[j], pieces[j] = tmp_pc;
+                tmp_sq = squares[i], squares[i] = squares[j], squares[j] = tmp_sq;
+                break;
+            }
+        }
+    }
+
+    if (squares[0] % 8 > 3) {
+        for (i = 0; i < size; i++)
+            squares[i] ^= 7;
+    }
+
+    if (e->has_pawns) {
+        idx = LEAD_PAWN_IDX[lead_pawns_cnt][squares[0]];
+
+        for (i = 2; i < lead_pawns_cnt; i++) { // insertion sort by MAP_PAWNS
+            for (j = i; j > 1 && MAP_PAWNS[squares[j - 1]] > MAP_PAWNS[squares[j]]; j--)
+                tmp_sq = squares[j], squares[j] = squares[j - 1], squares[j - 1] = tmp_sq;
+        }
+
+        for (i = 1; i < lead_pawns_cnt; i++)
+            idx += BINOMIAL[i][MAP_PAWNS[squares[i]]];
+    } else {
+        if (squares[0] / 8 > 3) {
+            for (i = 0; i < size; i++)
+                squares[i] ^= 56;
+        }
+
+        // the first leading piece off the a1-h8 diagonal goes below it
+        for (i = 0; i < d->group_len[0]; i++) {
+            if (!off_diagonal(squares[i]))
+                continue;
+
+            if (off_diagonal(squares[i]) > 0) {
+                for (j = i; j < size; j++)
+                    squares[j] = ((squares[j] >> 3) | (squares[j] << 3)) & 63;
+            }
+            break;
+        }
+
+        if (e->has_unique_pieces) {
+            int adjust1 = squares[1] > squares[0];
+            int adjust2 = (squares[2] > squares[0]) + (squares[2] > squares[1]);
+
+            if (off_diagonal(squares[0]))
+                idx = (MAP_A1D1D4[squares[0]] * 63 + (squares[1] - adjust1)) * 62 + squares[2] - adjust2;
+            else if (off_diagonal(squares[1]))
+                idx = (6 * 63 + (squares[0] / 8) * 28 + MAP_B1H1H7[squares[1]]) * 62 + squares[2] - adjust2;
+            else if (off_diagonal(squares[2]))
+                idx = 6 * 63 * 62 + 4 * 28 * 62 + (squares[0] / 8) * 7 * 28
+                    + (squares[1] / 8 - adjust1) * 28 + MAP_B1H1H7[squares[2]];
+            else
+                idx = 6 * 63 * 62 + 4 * 28 * 62 + 4 * 7 * 28 + (squares[0] / 8) * 7 * 6
+                    + (squares[1] / 8 - adjust1) * 6 + (squares[2] / 8 - adjust2);
+        } else {
+            idx = MAP_KK[MAP_A1D1D4[squares[0]]][squares[1]];
+        }
+    }
+
+    idx *= d->group_idx[0];
+    group_sq = squares + d->group_len[0];
+    remaining_pawns = e->has_pawns && e->pawn_count[1];
+
+    while (d->group_len[++next]) {
+        for (i = 1; i < d->group_len[next]; i++) { // insertion sort by square
+            for (j = i; j > 0 && group_sq[j - 1] > group_sq[j]; j--)
+                tmp_sq = group_sq[j], group_sq[j] = group_sq[j - 1], group_sq[j - 1] = tmp_sq;
+        }
+
+        // squares taken by earlier groups do not count
+        n = 0;
+        for (i = 0; i < d->group_len[next]; i++) {
+            int adjust = 0;
+            for (j = 0; j < group_sq - squares; j++)
+                adjust += group_sq[i] > squares[j];
+            n += BINOMIAL[i + 1][group_sq[i] - adjust - 8 * remaining_pawns];
+        }
+
+        remaining_pawns = false;
+        idx += n * d->group_idx[next];
+        group_sq += d->group_len[next];
+    }
+
+    value = decompress_pairs(d, idx);
+    if (!e->dtz)
+        return value - 2;
+
+    // DTZ values are stored by frequency, in moves unless the flags say plies
+    static const int WDL_MAP[] = { 1, 3, 0, 2, 0 };
+    d = table_data(e, 0, tb_file);
+    if (d->flags & TB_FLAG_MAPPED) {
+        if (d->flags & TB_FLAG_WIDE)
+            value = read_le16(e->map + 2 * (d->map_idx[WDL_MAP[wdl + 2]] + value));
+        else
+            value = e->map[d->map_idx[WDL_MAP[wdl + 2]] + value];
+    }
+
+    if ((wdl == TB_WIN && !(d->flags & TB_FLAG_WIN_PLIES)) || (wdl == TB_LOSS && !(d->flags & TB_FLAG_LOSS_PLIES))
+            || wdl == TB_CURSED_WIN || wdl == TB_BLESSED_LOSS)
+        value *= 2;
+
+    return value + 1;
+}
+
+/*
+ * Splits the pieces into groups numbered together: the leading pawns or the
+ * three unique pieces or the kings, then runs of the same piece. The order
+ * the groups multiply in is stored per table.
+ */
+static void set_groups(TBTable *e, PairsData *d, int order[2], int file) {
+    int i, k, n = 0, first_len = e->has_pawns ? 0 : e->has_unique_pieces ? 3 : 2;
+    bool pp = e->has_pawns && e->pawn_count[1];
+    int next = pp ? 2 : 1;
+    int free_squares;
+    U64 idx = 1;
+
+    d->group_len[n] = 1;
+    for (i = 1; i < e->piece_count; i++) {
+        if (--first_len > 0 || d->pieces[i] == d->pieces[i - 1])
+            d->group_len[n]++;
+        else
+            d->group_len[++n] = 1;
+    }
+    d->group_len[++n] = 0;
+
+    free_squares = 64 - d->group_len[0] - (pp ? d->group_len[1] : 0);
+    for (k = 0; next < n || k == order[0] || k == order[1]; k++) {
+        if (k == order[0]) {
+            d->group_idx[0] = idx;
+            idx *= e->has_pawns ? LEAD_PAWNS_SIZE[d->group_len[0]][file]
+                : e->has_unique_pieces ? 31332 : 462;
+        } else if (k == order[1]) {
+            d->group_idx[1] = idx;
+            idx *= BINOMIAL[d->group_len[1]][48 - d->group_len[0]];
+        } else {
+            d->group_idx[next] = idx;
+            idx *= BINOMIAL[d->group_len[next]][free_squares];
+            free_squares -= d->group_len[next++];
+        }
+    }
+
+    d->group_idx[n] = idx;
+}
+
+// values represented by a symbol minus one, summed over its children
+static U8 set_symlen(PairsData *d, int sym, bool *visited) {
+    int left, right;
+
+    visited[sym] = true;
+    right = btree_right(d, sym);
+    if (right == 0xfff)
+        return 0;
+
+    left = btree_left(d, sym);
+    if (!visited[left])
+        d->symlen[left] = set_symlen(d, left, visited);
+    if (!visited[right])
+        d->symlen[right] = set_symlen(d, right, visited);
+
+    return d->symlen[left] + d->symlen[right] + 1;
+}
+
+// Reads the Huffman code of a block, returns the data after it.
+static U8* set_sizes(PairsData *d, U8 *data) {
+    int i, num_lengths, num_syms;
+    U64 tb_size;
+    U8 padding;
+    bool *visited;
+
+    d->flags = *data++;
+    if (d->flags & TB_FLAG_SINGLE) {
+        d->min_sym_len = *data++;
+        return data;
+    }
+
+    for (i = 0; d->group_len[i]; i++)
+        ;
+    tb_size = d->group_idx[i];
+
+    d->block_size = 1ULL << *data++;
+    d->span = 1ULL << *data++;
+    d->sparse_index_size = (tb_size + d->span - 1) / d->span;
+    padding = *data++;
+    d->num_blocks = read_le32(data);
+    data += 4;
+    d->block_length_size = d->num_blocks + padding; // so sparse_index never points past the end
+    d->max_sym_len = *data++;
+    d->min_sym_len = *data++;
+    d->lowest_sym = data;
+
+    // canonical Huffman code, longer codes have lower values
+    num_lengths = d->max_sym_len - d->min_sym_len + 1;
+    d->base64 = calloc(num_lengths, sizeof(U64));
+    for (i = num_lengths - 2; i >= 0; i--) {
+        d->base64[i] = (d->base64[i + 1] + read_le16(d->lowest_sym + 2 * i)
+                - read_le16(d->lowest_sym + 2 * (i + 1))) / 2;
+    }
+    for (i = 0; i < num_lengths; i++)
+        d->base64[i] <<= 64 - i - d->min_sym_len;
+
+    data += 2 * num_lengths;
+    num_syms = read_le16(data);
+    data += 2;
+    d->btree = data;
+
+    d->symlen = calloc(num_syms, sizeof(U8));
+    visited = calloc(num_syms, sizeof(bool));
+    for (i = 0; i < num_syms; i++) {
+        if (!visited[i])
+            d->symlen[i] = set_symlen(d, i, visited);
+    }
+    free(visited);
+
+    return data + 3 * num_syms + (num_syms & 1);
+}
+
+// Reads the value maps of a DTZ table, returns the data after them.
+static U8* set_dtz_map(TBTable *e, U8 *data, int max_file) {
+    PairsData *d;
+    int f, i;
+
+    e->map = data;
+    for (f = 0; f <= max_file; f++) {
+        d = table_data(e, 0, f);
+        if (!(d->flags & TB_FLAG_MAPPED))
+            continue;
+
+        if (d->flags & TB_FLAG_WIDE) {
+            data += (uintptr_t)data & 1;
+            for (i = 0; i < 4; i++) {
+                d->map_idx[i] = (data - e->map) / 2 + 1;
+                data += 2 * read_le16(data) + 2;
+            }
+        } else {
+            for (i = 0; i < 4; i++) {
+                d->map_idx[i] = data - e->map + 1;
+                data += *data + 1;
+            }
+        }
+    }
+
+    return data + ((uintptr_t)data & 1);
+}
+
+// Points the decoding state into a freshly mapped file, returns the end of
+// the data it found.
+static U8* set_table(TBTable *e, U8 *data) {
+    int sides = !e->dtz && e->key != e->key2 ? 2 : 1;
+    int max_file = e->has_pawns ? 3 : 0;
+    bool pp = e->has_pawns && e->pawn_count[1];
+    int f, i, k;
+    PairsData *d;
+    U8 *end;
+
+    data++; // flags, which the registration already knows
+    for (f = 0; f <= max_file; f++) {
+        int order[2][2] = {
+            { *data & 0xf, pp ? data[1] & 0xf : 0xf },
+            { *data >> 4, pp ? data[1] >> 4 : 0xf },
+        };
+        data += 1 + pp;
+
+        for (k = 0; k < e->piece_count; k++, data++) {
+            for (i = 0; i < sides; i++)
+                table_data(e, i, f)->pieces[k] = i ? *data >> 4 : *data & 0xf;
+        }
+
+        for (i = 0; i < sides; i++)
+            set_groups(e, table_data(e, i, f), order[i], f);
+    }
+
+    data += (uintptr_t)data & 1;
+    for (f = 0; f <= max_file; f++) {
+        for (i = 0; i < sides; i++)
+            data = set_sizes(table_data(e, i, f), data);
+    }
+
+    if (e->dtz)
+        data = set_dtz_map(e, data, max_file);
+
+    for (f = 0; f <= max_file; f++) {
+        for (i = 0; i < sides; i++) {
+            d = table_data(e, i, f);
+            d->sparse_index = data;
+            data += 6 * d->sparse_index_size;
+        }
+    }
+
+    for (f = 0; f <= max_file; f++) {
+        for (i = 0; i < sides; i++) {
+            d = table_data(e, i, f);
+            d->block_length = data;
+            data += 2 * d->block_length_size;
+        }
+    }
+
+    // single valued tables may end before the alignment
+    end = data;
+    for (f = 0; f <= max_file; f++) {
+        for (i = 0; i < sides; i++) {
+            d = table_data(e, i, f);
+            data = (U8*)(((uintptr_t)data + 0x3f) & ~(uintptr_t)0x3f);
+            d->data = data;
+            data += d->num_blocks * d->block_size;
+            if (d->num_blocks)
+                end = data;
+        }
+    }
+
+    return end;
+}
+
+static void unmap_table(TBTable *e) {
+    int i, f;
+
+    for (i = 0; i < NUM_COLORS; i++) {
+        for (f = 0; f < 4; f++) {
+            free(e->items[i][f].base64);
+            free(e->items[i][f].symlen);
+        }
+    }
+
+    if (e->base)
+        munmap(e->base, e->size);
+    memset(e->items, 0, sizeof(e->items));
+    e->base = NULL;
+}
+
+// Opens the file of a table in the first directory of SyzygyPath holding it.
+static int open_table(TBTable *e) {
+    char path[4096], *paths = strdup(TB_PATHS), *dir, *save;
+    int fd = -1;
+
+    for (dir = strtok_r(paths, ":", &save); dir && fd < 0; dir = strtok_r(NULL, ":", &save)) {
+        snprintf(path, sizeof(path), "%s/%s%s", dir, e->name, e->dtz ? ".rtbz" : ".rtbw");
+        fd = open(path, O_RDONLY);
+    }
+
+    free(paths);
+    return fd;
+}
+
+static void map_table_file(TBTable *e) {
+    struct stat st;
+    U8 *data;
+    int fd = open_table(e);
+
+    if (fd < 0) // DTZ files are optional
+        return;
+
+    if (fstat(fd, &st) < 0 || st.st_size % 64 != 16) {
+        fprintf(stderr, "Rejecting corrupted tablebase %s.\n", e->name);
+        close(fd);
+        return;
+    }
+
+    e->base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (e->base == MAP_FAILED) {
+        fprintf(stderr, "Error mapping tablebase %s.\n", e->name);
+        e->base = NULL;
+        return;
+    }
+
+    e->size = st.st_size;
+    data = e->base;
+    if (memcmp(data, e->dtz ? DTZ_MAGIC : WDL_MAGIC, 4)
+            || (bool)(data[4] & 2) != e->has_pawns || (bool)(data[4] & 1) != (e->key != e->key2)
+            || set_table(e, data + 4) > data + e->size) {
+        fprintf(stderr, "Rejecting corrupted tablebase %s.\n", e->name);
+        unmap_table(e);
+    }
+}
+
+// Maps a table on its first probe, safe to call from every search thread.
+static bool map_table(TBTable *e) {
+    if (atomic_load_explicit(&e->ready, memory_order_acquire))
+        return e->base != NULL;
+
+    pthread_mutex_lock(&TB_MAP_LOCK);
+    if (!atomic_load_explicit(&e->ready, memory_order_relaxed)) {
+        map_table_file(e);
+        atomic_store_explicit(&e->ready, true, memory_order_release);
+    }
+    pthread_mutex_unlock(&TB_MAP_LOCK);
+
+    return e->base != NULL;
+}
+
+static TBTable* find_table(U64 key, bool dtz) {
+    int i;
+
+    for (i = key & (TB_HASH_SIZE - 1); TB_HASH[i]; i = (i + 1) & (TB_HASH_SIZE - 1)) {
+        if (TB_HASH_KEYS[i] == key)
+            return (dtz ? DTZ_TABLES : WDL_TABLES) + TB_HASH[i] - 1;
+    }
+
+    return NULL;
+}
+
+static int probe_table(Board *board, bool dtz, int wdl, int *result) {
+    TBTable *e;
+
+    if (POP_COUNT(board->colors[WHITE] | board->colors[BLACK]) == 2)
+        return TB_DRAW;
+
+    e = find_table(board->material_key, dtz);
+    if (e == NULL || !map_table(e)) {
+        *result = PROBE_FAIL;
+        return 0;
+    }
+
+    return do_probe_table(board, e, wdl, result);
+}
+
+/*
+ * The generator stores whatever compresses best for positions where a
+ * capture is at least as good, so captures (and pawn moves for DTZ) are
+ * searched and the best of them and the stored value wins.
+ */
+static int probe_search(Board *board, bool zeroing_moves, int *result) {
+    ScoredMove list[MAX_NUM_LEGAL_MOVES], *end = legal_moves(board, list), *curr;
+    int value, best = TB_LOSS, move_count = 0;
+    bool no_more_moves;
+
+    for (curr = list; curr < end; curr++) {
+        if (!is_capture(curr->move) && (!zeroing_moves || board->squares[get_from(curr->move)] != PAWN_IDX))
+            continue;
+
+        move_count++;
+        make_move(board, curr->move);
+        value = -probe_search(board, false, result);
+        unmake_move(board, curr->move);
+
+        if (*result == PROBE_FAIL)
+            return TB_DRAW;
+
+        if (value > best) {
+            best = value;
+            if (value >= TB_WIN) {
+                *result = PROBE_ZEROING;
+                return value;
+            }
+        }
+    }
+
+    // with every move searched the stored value may be wrong, e.g. en passant
+    no_more_moves = move_count && move_count == end - list;
+    if (no_more_moves) {
+        value = best;
+    } else {
+        value = probe_table(board, false, TB_DRAW, result);
+        if (*result == PROBE_FAIL)
+            return TB_DRAW;
+    }
+
+    if (best >= value) {
+        *result = best > TB_DRAW || no_more_moves ? PROBE_ZEROING : PROBE_OK;
+        return best;
+    }
+
+    *result = PROBE_OK;
+    return value;
+}
+
+// Plies to the next capture or pawn move, signed as the WDL result.
+static int probe_dtz(Board *board, int *result) {
+    ScoredMove list[MAX_NUM_LEGAL_MOVES], *end, *curr;
+    int wdl, dtz, min_dtz = 0xffff;
+    bool zeroing;
+
+    *result = PROBE_OK;
+    wdl = probe_search(board, true, result);
+    if (*result == PROBE_FAIL || wdl == TB_DRAW)
+        return 0;
+
+    if (*result == PROBE_ZEROING)
+        return dtz_before_zeroing(wdl);
+
+    dtz = probe_table(board, true, wdl, result);
+    if (*result == PROBE_FAIL)
+        return 0;
+
+    if (*result != PROBE_CHANGE_STM)
+        return (dtz + 100 * (wdl == TB_BLESSED_LOSS || wdl == TB_CURSED_WIN)) * sign(wdl);
+
+    // the table only has the other side to move, search one ply for the
+    // move that keeps the result with the lowest DTZ
+    end = legal_moves(board, list);
+    for (curr = list; curr < end; curr++) {
+        zeroing = is_capture(curr->move) || board->squares[get_from(curr->move)] == PAWN_IDX;
+
+        make_move(board, curr->move);
+        if (zeroing)
+            dtz = -dtz_before_zeroing(probe_search(board, false, result));
+        else
+            dtz = -probe_dtz(board, result);
+
+        // a mate is one ply, before the ply of the move is added below
+        if (dtz == 1 && is_in_check(board) && !count_legal_moves(board))
+            min_dtz = 1;
+        unmake_move(board, curr->move);
+
+        if (!zeroing)
+            dtz += sign(dtz);
+
+        if (dtz < min_dtz && sign(dtz) == sign(wdl))
+            min_dtz = dtz;
+
+        if (*result == PROBE_FAIL)
+            return 0;
+    }
+
+    return min_dtz == 0xffff ? -1 : min_dtz; // no legal moves, mated
+}
+
+// zobrist material key of a table name, pieces as [color][piece]
+static U64 tb_key(int counts[NUM_COLORS][NUM_PIECES], bool first_color) {
+    U64 key = 0ULL;
+    int i, j, n;
+
+    for (i = 0; i < NUM_PIECES; i++) {
+        for (j = 0; j < NUM_COLORS; j++) {
+            for (n = 0; n < counts[j][i]; n++)
+                key ^= ZOBRIST_MATERIAL[i][j ^ first_color][n];
+        }
+    }
+
+    return key;
+}
+
+static void insert_key(U64 key, int table) {
+    int i = key & (TB_HASH_SIZE - 1);
+
+    while (TB_HASH[i])
+        i = (i + 1) & (TB_HASH_SIZE - 1);
+
+    TB_HASH[i] = table + 1;
+    TB_HASH_KEYS[i] = key;
+}
+
+static bool table_exists(const char *name) {
+    char path[4096], *paths = strdup(TB_PATHS), *dir, *save;
+    bool found = false;
+
+    for (dir = strtok_r(paths, ":", &save); dir && !found; dir = strtok_r(NULL, ":", &save)) {
+        snprintf(path, sizeof(path), "%s/%s.rtbw", dir, name);
+        found = access(path, R_OK) == 0;
+    }
+
+    free(paths);
+    return found;
+}
+
+// Registers a table if its WDL file exists, the DTZ file is looked for when
+// it is first probed.
+static void add_table(int counts[NUM_COLORS][NUM_PIECES]) {
+    static const char PIECE_CHARS[] = "PNBRQK";
+    TBTable *wdl, *dtz;
+    char name[TB_PIECES + 2];
+    int i, j, n, len = 0, pieces = 0;
+    U64 key = tb_key(counts, WHITE);
+
+    if (NUM_TABLES == TB_MAX_TABLES || find_table(key, false))
+        return;
+
+    for (i = 0; i < NUM_COLORS; i++) {
+        if (i)
+            name[len++] = 'v';
+        for (j = KING_IDX; j >= PAWN_IDX; j--) {
+            for (n = 0; n < counts[i][j]; n++, pieces++)
+                name[len++] = PIECE_CHARS[j];
+        }
+    }
+    name[len] = '\0';
+
+    if (!table_exists(name))
+        return;
+
+    wdl = &WDL_TABLES[NUM_TABLES];
+    memset(wdl, 0, sizeof(TBTable));
+    strcpy(wdl->name, name);
+    wdl->key = key;
+    wdl->key2 = tb_key(counts, BLACK);
+    wdl->piece_count = pieces;
+    wdl->has_pawns = counts[WHITE][PAWN_IDX] || counts[BLACK][PAWN_IDX];
+    for (i = 0; i < NUM_COLORS; i++) {
+        for (j = PAWN_IDX; j < KING_IDX; j++)
+            wdl->has_unique_pieces |= counts[i][j] == 1;
+    }
+
+    // the side with fewer pawns leads, it compresses better
+    i = !counts[BLACK][PAWN_IDX] || (counts[WHITE][PAWN_IDX] && counts[BLACK][PAWN_IDX] >= counts[WHITE][PAWN_IDX])
+        ? WHITE : BLACK;
+    wdl->pawn_count[0] = counts[i][PAWN_IDX];
+    wdl->pawn_count[1] = counts[!i][PAWN_IDX];
+
+    dtz = &DTZ_TABLES[NUM_TABLES];
+    *dtz = *wdl;
+    dtz->dtz = true;
+
+    insert_key(wdl->key, NUM_TABLES);
+    if (wdl->key2 != wdl->key)
+        insert_key(wdl->key2, NUM_TABLES);
+
+    NUM_TABLES++;
+    TB_LARGEST = MAX(TB_LARGEST, pieces);
+}
+
+// Unmaps every table and switches probing off.
+void tb_free() {
+    int i;
+
+    for (i = 0; i < NUM_TABLES; i++) {
+        unmap_table(&WDL_TABLES[i]);
+        unmap_table(&DTZ_TABLES[i]);
+    }
+
+    free(WDL_TABLES);
+    free(DTZ_TABLES);
+    free(TB_PATHS);
+    WDL_TABLES = DTZ_TABLES = NULL;
+    TB_PATHS = NULL;
+    NUM_TABLES = 0;
+    TB_LARGEST = 0;
+    memset(TB_HASH, 0, sizeof(TB_HASH));
+}
+
+/*
+ * Looks for the tables of every material split up to TB_PIECES pieces in a
+ * colon separated list of directories. Needs the zobrist keys & move tables.
+ * An empty path switches tablebases off.
+ */
+bool tb_init(const char *paths) {
+    int counts[NUM_COLORS][NUM_PIECES] = {{0}};
+    int w, b, i, n, sum_w, sum_b;
+    int num_sets = 1;
+
+    tb_free();
+    if (*paths == '\0' || !strcmp(paths, "<empty>"))
+        return true;
+
+    if (!TB_INDEX_READY)
+        init_tb_index();
+
+    TB_PATHS = strdup(paths);
+    WDL_TABLES = malloc(TB_MAX_TABLES * sizeof(TBTable));
+    DTZ_TABLES = malloc(TB_MAX_TABLES * sizeof(TBTable));
+    if (TB_PATHS == NULL || WDL_TABLES == NULL || DTZ_TABLES == NULL) {
+        fprintf(stderr, "Error allocating tablebases.\n");
+        tb_free();
+        return false;
+    }
+
+    // every count of pawns to queens is a digit below TB_PIECES - 1
+    for (i = 0; i < KING_IDX; i++)
+        num_sets *= TB_PIECES - 1;
+
+    for (w = 0; w < num_sets; w++) {
+        for (b = 0; b < num_sets; b++) {
+            sum_w = sum_b = 0;
+            for (i = 0, n = 1; i < KING_IDX; i++, n *= TB_PIECES - 1) {
+                counts[WHITE][i] = w / n % (TB_PIECES - 1);
+                counts[BLACK][i] = b / n % (TB_PIECES - 1);
+                sum_w += counts[WHITE][i];
+                sum_b += counts[BLACK][i];
+            }
+
+            if (sum_w + sum_b + 2 > TB_PIECES || sum_w + sum_b == 0)
+                continue;
+
+            counts[WHITE][KING_IDX] = counts[BLACK][KING_IDX] = 1;
+            add_table(counts);
+        }
+    }
+
+    if (!NUM_TABLES)
+        fprintf(stderr, "No tablebases found in %s.\n", paths);
+    return NUM_TABLES > 0;
+}
+
+// Whether the tables cover the piece count, castling rights are not stored.
+bool tb_covers(Board *board) {
+    return POP_COUNT(board->colors[WHITE] | board->colors[BLACK]) <= TB_LARGEST
+        && !(board->history[board->ply].state & CASTLING_MASK);
+}
+
+int tb_num_tables() {
+    return NUM_TABLES;
+}
+
+// Win/draw/loss of the side to move, for positions without castling rights
+// whose half-move clock was just reset.
+bool tb_probe_wdl(Board *board, int *wdl) {
+    int result = PROBE_OK;
+
+    *wdl = probe_search(board, false, &result);
+    return result != PROBE_FAIL;
+}
+
+bool tb_probe_dtz(Board *board, int *dtz) {
+    int result;
+
+    *dtz = probe_dtz(board, &result);
+    return result != PROBE_FAIL;
+}
+
+/*
+ * Ranks the root moves by DTZ and keeps the best ones: the fastest win, the
+ * longest defence or the draws. A win or loss the 50-move rule would reach
+ * first counts as a draw. Returns the number of moves kept, 0 if a table is
+ * missing.
+ */
+int tb_root_moves(Board *board, Move *moves) {
+    ScoredMove list[MAX_NUM_LEGAL_MOVES], *end = legal_moves(board, list), *curr;
+    int ranks[MAX_NUM_LEGAL_MOVES];
+    int i, n = 0, dtz, result = PROBE_OK, best = -0xffff;
+    int half_moves = board->history[board->ply].state & HALF_MOVE_MASK;
+
+    for (curr = list, i = 0; curr < end; curr++, i++) {
+        make_move(board, curr->move);
+        if (!(board->history[board->ply].state & HALF_MOVE_MASK)) {
+            result = PROBE_OK;
+            dtz = dtz_before_zeroing(-probe_search(board, false, &result));
+        } else {
+            dtz = -probe_dtz(board, &result);
+            dtz += sign(dtz);
+        }
+
+        if (dtz == 2 && is_in_check(board) && !count_legal_moves(board))
+            dtz = 1;
+        unmake_move(board, curr->move);
+
+        if (result == PROBE_FAIL)
+            return 0;
+
+        ranks[i] = dtz > 0 && dtz + half_moves <= 99 ? 1000 - dtz
+            : dtz < 0 && -dtz + half_moves <= 100 ? -1000 - dtz : 0;
+        best = MAX(best, ranks[i]);
+    }
+
+    for (curr = list, i = 0; curr < end; curr++, i++) {
+        if (ranks[i] == best)
+            moves[n++] = curr->move;
+    }
+
+    return n;
+}
@@ -1,21 +1,73 @@
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if TT_NUMA
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
 #include "eval.h"
 #include "table.h"
 #include "types.h"
 #include "utils.h"
 
-static TTEntry* T_TABLE = NULL;
-static U64 TT_ENTRIES = 0;
+#define TT_MATE 30000
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define MAX_CLEAR_THREADS 64
+#define PAWN_TT_ENTRIES (1 << 16) // 1 MB
+#define MATERIAL_TT_ENTRIES (1 << 13)
+#define MATERIAL_VALID (1ULL << 56)
+#define ZOBRIST_SEED 0ULL
+#define TT_FILE_MAGIC 0x485341484e5a4e4dULL // "MNZNHASH"
+#define TT_FILE_VERSION 1
+
+#ifndef GIT_HASH
+#define GIT_HASH "unknown"
+#endif
+
+/*
+ * Header of a saved table. Files written by another build, with other Zobrist
+ * keys or another entry layout are rejected, as their entries would be noise.
+ * The buckets follow the header, which is a cache line long so they stay
+ * aligned in the mapping.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) U64 magic;
+    U32 version;
+    U32 entry_size;
+    U64 zobrist_seed;
+    U64 zobrist_check; // ZOBRIST_BLACK, catches a changed key generator
+    U64 buckets;
+    U8  generation;
+    char engine[16];
+} TTFileHeader;
+
+TTBucket* T_TABLE = NULL;
+static void* TT_MAPPING = NULL; // start of the mmap region, if mapped
+static size_t TT_MAPPING_SIZE = 0;
+U64 TT_BUCKETS = 0;
+static U8 TT_GENERATION = 0;
+static PerftEntry* PERFT_TABLE = NULL;
+static U64 PERFT_ENTRIES = 0;
+static PawnEntry PAWN_TABLE[PAWN_TT_ENTRIES];
+static PawnEntry MATERIAL_TABLE[MATERIAL_TT_ENTRIES];
+// per thread, so counting costs no shared writes
+static _Thread_local U64 PAWN_PROBES = 0;
+static _Thread_local U64 PAWN_HITS = 0;
 
 // Zobrist hashes
 U64 ZOBRIST_PIECE_SQ[NUM_PIECES][NUM_COLORS][NUM_SQUARES];
 U64 ZOBRIST_BLACK;
 U64 ZOBRIST_CASTLING[16];
 U64 ZOBRIST_EP[8];
+U64 ZOBRIST_MATERIAL[NUM_PIECES][NUM_COLORS][16];
 
 void init_zobrist() {
     int i, j, k;
-    psrng_u64_seed(0ULL);
+    psrng_u64_seed(ZOBRIST_SEED);
 
     for (i = 0; i < NUM_PIECES; i++) {
         for (j = 0; j < NUM_COLORS; j++) {
@@ -37,57 +89,416 @@ void init_zobrist() {
         ZOBRIST_EP[i] = psrng_u64();
         //ZOBRIST_EP[i] = 0;
     }
+
+    // drawn after every other key, so those stay the same
+    for (i = 0; i < NUM_PIECES; i++) {
+        for (j = 0; j < NUM_COLORS; j++) {
+            for (k = 0; k < 16; k++) {
+                ZOBRIST_MATERIAL[i][j][k] = psrng_u64();
+            }
+        }
+    }
+}
+
+// Maps the table on huge page boundaries and asks for transparent huge pages,
+// which cuts TLB misses on large tables. Falls back to aligned_alloc when
+// mmap is refused.
+static TTBucket* tt_alloc(size_t bytes) {
+#ifdef MADV_HUGEPAGE
+    size_t size = bytes + HUGE_PAGE_SIZE;
+    char* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mem != MAP_FAILED) {
+        TT_MAPPING = mem;
+        TT_MAPPING_SIZE = size;
+        mem += (HUGE_PAGE_SIZE - (size_t)mem % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+        madvise(mem, bytes, MADV_HUGEPAGE);
+#if TT_NUMA
+        // spread pages over every node, single node hosts accept the policy
+        // and keep allocating locally
+        unsigned long nodes = ~0UL;
+        if (syscall(SYS_mbind, mem, bytes, MPOL_INTERLEAVE, &nodes, sizeof(nodes) * 8, 0))
+            printf("info string NUMA interleaving failed: %s\n", strerror(errno));
+#endif
+        return (TTBucket*)mem;
+    }
+#endif
+
+    return aligned_alloc(CACHE_LINE, bytes);
+}
+
+static void tt_free() {
+    if (TT_MAPPING)
+        munmap(TT_MAPPING, TT_MAPPING_SIZE);
+    else
+        free(T_TABLE);
+
+    TT_MAPPING = NULL;
+    T_TABLE = NULL;
+    TT_BUCKETS = 0;
 }
 
 void tt_set_size(int mb_size) {
     if (T_TABLE)
-        free(T_TABLE);
+        tt_free();
     
     U64 byte_size = (U64)mb_size * 1024 * 1024;
-    TT_ENTRIES = byte_size / sizeof(TTEntry);
-    T_TABLE = malloc(sizeof(TTEntry) * TT_ENTRIES);
+    TT_BUCKETS = byte_size / sizeof(TTBucket);
+    T_TABLE = tt_alloc(sizeof(TTBucket) * TT_BUCKETS);
     if (T_TABLE == NULL) {
         fprintf(stderr, "Error allocating space for transposition table of size %dmb.\n", mb_size);
-        TT_ENTRIES = 0;
+        TT_BUCKETS = 0;
     } else {
-        memset(T_TABLE, 0, TT_ENTRIES * sizeof(TTEntry));
+        tt_clear();
     }
 }
 
-TTEntry* tt_probe(U64 key) {
-    if (!TT_ENTRIES)
-        return NULL;
+static void* clear_worker(void* arg) {
+    size_t i = (size_t)arg;
+    size_t threads = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), MAX_CLEAR_THREADS);
+    size_t chunk = (TT_BUCKETS + threads - 1) / threads;
+    size_t start = MIN(i * chunk, TT_BUCKETS);
 
-    TTEntry* entry = &T_TABLE[key % TT_ENTRIES];
+    memset(&T_TABLE[start], 0, (MIN(start + chunk, TT_BUCKETS) - start) * sizeof(TTBucket));
+    return NULL;
+}
 
-    if (entry->key == key)
-        return entry;
+// Clears the table with one thread per online cpu. Each thread touches its
+// own slice first, so on NUMA hosts the pages are spread over the nodes.
+void tt_clear() {
+    pthread_t threads[MAX_CLEAR_THREADS];
+    size_t i, num_threads = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), MAX_CLEAR_THREADS);
 
-    return NULL;
+    for (i = 1; i < num_threads; i++)
+        pthread_create(&threads[i], NULL, clear_worker, (void*)i);
+    clear_worker((void*)0);
+    for (i = 1; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    TT_GENERATION = 0;
+}
+
+static void tt_file_header(TTFileHeader* header) {
+    memset(header, 0, sizeof(TTFileHeader));
+    header->magic = TT_FILE_MAGIC;
+    header->version = TT_FILE_VERSION;
+    header->entry_size = sizeof(PackedTTEntry);
+    header->zobrist_seed = ZOBRIST_SEED;
+    header->zobrist_check = ZOBRIST_BLACK;
+    header->buckets = TT_BUCKETS;
+    header->generation = TT_GENERATION;
+    strncpy(header->engine, GIT_HASH, sizeof(header->engine) - 1);
+}
+
+// Writes the table to a file through a shared mapping.
+bool tt_save_file(char* path) {
+    size_t bytes = TT_BUCKETS * sizeof(TTBucket);
+    char* mem;
+    int fd;
+
+    if (!TT_BUCKETS)
+        return false;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, sizeof(TTFileHeader) + bytes) < 0) {
+        fprintf(stderr, "Error creating hash file %s.\n", path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    mem = mmap(NULL, sizeof(TTFileHeader) + bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "Error mapping hash file %s.\n", path);
+        return false;
+    }
+
+    tt_file_header((TTFileHeader*)mem);
+    memcpy(mem + sizeof(TTFileHeader), T_TABLE, bytes);
+    munmap(mem, sizeof(TTFileHeader) + bytes);
+
+    return true;
+}
+
+// Replaces the table with one saved by tt_save_file, resizing it to the saved
+// size. Returns the new size in megabytes, or -1 if the file is rejected.
+int tt_load_file(char* path) {
+    TTFileHeader expected, *header;
+    struct stat st;
+    char* mem;
+    int fd, mb_size = -1;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TTFileHeader)) {
+        fprintf(stderr, "Error opening hash file %s.\n", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        fprintf(stderr, "Error mapping hash file %s.\n", path);
+        return -1;
+    }
+
+    header = (TTFileHeader*)mem;
+    tt_file_header(&expected);
+    if (header->magic != expected.magic || header->version != expected.version
+            || header->entry_size != expected.entry_size
+            || header->zobrist_seed != expected.zobrist_seed
+            || header->zobrist_check != expected.zobrist_check
+            || strncmp(header->engine, expected.engine, sizeof(header->engine))
+            || (size_t)st.st_size != sizeof(TTFileHeader) + header->buckets * sizeof(TTBucket)) {
+        fprintf(stderr, "Rejecting hash file %s written by another engine build.\n", path);
+    } else {
+        mb_size = header->buckets * sizeof(TTBucket) / (1024 * 1024);
+        if (header->buckets != TT_BUCKETS)
+            tt_set_size(mb_size);
+
+        if (TT_BUCKETS == header->buckets) {
+            memcpy(T_TABLE, mem + sizeof(TTFileHeader), TT_BUCKETS * sizeof(TTBucket));
+            TT_GENERATION = header->generation;
+        } else {
+            mb_size = -1;
+        }
+    }
+
+    munmap(mem, st.st_size);
+    return mb_size;
+}
+
+// Called once per search. Entries saved by older searches become the first
+// candidates for replacement.
+void tt_new_search() {
+    TT_GENERATION = (TT_GENERATION + 1) & 0x3f;
+}
+
+// indexed by the 2 bound bits of a packed entry
+static const char BOUND_TYPES[4] = { EMPTY_NODE, EXACT_NODE, ALL_NODE, CUT_NODE };
+
+static inline U8 pack_bound(char type) {
+    switch (type) {
+        case EXACT_NODE: return 1;
+        case ALL_NODE:   return 2;
+        case CUT_NODE:   return 3;
+        default:         return 0;
+    }
+}
+
+// mate scores lie just above CHECKMATE_CP, move them just above TT_MATE
+static inline int16_t pack_score(int score) {
+    if (score > CHECKMATE_CP)
+        score -= CHECKMATE_CP - TT_MATE;
+    else if (score < -CHECKMATE_CP)
+        score += CHECKMATE_CP - TT_MATE;
+
+    return MAX(MIN(score, INT16_MAX), -INT16_MAX);
+}
+
+static inline int unpack_score(int16_t score) {
+    if (score > TT_MATE)
+        return score + CHECKMATE_CP - TT_MATE;
+    else if (score < -TT_MATE)
+        return score - CHECKMATE_CP + TT_MATE;
+
+    return score;
+}
+
+static inline U8 tt_age(PackedTTEntry entry) {
+    return (TT_GENERATION - (entry.bound_age >> 2)) & 0x3f;
+}
+
+static inline PackedTTEntry tt_load(PackedTTEntry* slot) {
+    return (PackedTTEntry){ .raw = __atomic_load_n(&slot->raw, __ATOMIC_RELAXED) };
+}
+
+bool tt_probe(U64 key, TTEntry* entry) {
+    if (!TT_BUCKETS)
+        return false;
+
+    PackedTTEntry* slot = tt_bucket(key)->entries;
+    PackedTTEntry curr, aged;
+    int i;
+
+    for (i = 0; i < (int)TT_BUCKET_SIZE; i++) {
+        curr = tt_load(&slot[i]);
+        if (curr.key == (U16)key && (curr.bound_age & 0x3)) {
+            // refresh the age unless another thread rewrote the slot meanwhile
+            aged = curr;
+            aged.bound_age = (TT_GENERATION << 2) | (curr.bound_age & 0x3);
+            if (aged.raw != curr.raw)
+                __atomic_compare_exchange_n(&slot[i].raw, &curr.raw, aged.raw, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+            entry->score = unpack_score(aged.score);
+            entry->best = aged.best;
+            entry->type = BOUND_TYPES[aged.bound_age & 0x3];
+            entry->depth = aged.depth;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Searches older than the current one count as 8 plies of depth each, so
+// stale deep entries are eventually replaced by fresh shallow ones.
+static inline int tt_worth(PackedTTEntry entry) {
+    return entry.depth - 8 * tt_age(entry);
 }
 
 void tt_save(U64 key, U8 depth, int score, Move best, char type) {
-    if (!TT_ENTRIES)
+    if (!TT_BUCKETS)
         return;
     
-    TTEntry* entry = &T_TABLE[key % TT_ENTRIES];
+    PackedTTEntry* slot = tt_bucket(key)->entries;
+    PackedTTEntry* replace = slot;
+    PackedTTEntry curr, old = tt_load(slot);
+    int i;
+
+    for (i = 0; i < (int)TT_BUCKET_SIZE; i++) {
+        curr = tt_load(&slot[i]);
+        if (curr.key == (U16)key || !(curr.bound_age & 0x3)) {
+            replace = &slot[i];
+            old = curr;
+            break;
+        }
+
+        if (tt_worth(curr) < tt_worth(old)) {
+            replace = &slot[i];
+            old = curr;
+        }
+    }
+
+    if (old.key == (U16)key && (old.bound_age & 0x3)
+            && !tt_age(old) && old.depth > depth)
+        return;
+
+    curr.key = (U16)key;
+    curr.depth = depth;
+    curr.score = pack_score(score);
+    curr.best = best;
+    curr.bound_age = (TT_GENERATION << 2) | pack_bound(type);
+    __atomic_store_n(&replace->raw, curr.raw, __ATOMIC_RELAXED);
+}
+
+void perft_tt_set_size(int mb_size) {
+    if (PERFT_TABLE)
+        free(PERFT_TABLE);
+
+    U64 byte_size = (U64)mb_size * 1024 * 1024;
+    PERFT_ENTRIES = byte_size / sizeof(PerftEntry);
+    PERFT_TABLE = calloc(PERFT_ENTRIES, sizeof(PerftEntry));
+    if (PERFT_TABLE == NULL) {
+        fprintf(stderr, "Error allocating space for perft table of size %dmb.\n", mb_size);
+        PERFT_ENTRIES = 0;
+    }
+}
+
+bool perft_tt_probe(U64 key, int depth, U64 *nodes) {
+    if (!PERFT_ENTRIES)
+        return false;
 
-    if ((entry->key == key) && entry->depth > depth) return;
-    //if ((entry->key == key) && (entry->depth > depth || mate_depth(score))) return;
-    //if (entry->key != key) return;
+    PerftEntry* entry = &PERFT_TABLE[key % PERFT_ENTRIES];
+    U64 entry_key = __atomic_load_n(&entry->key, __ATOMIC_RELAXED);
+    U64 data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+
+    if ((entry_key ^ data) != key || (int)(data & 0xff) != depth)
+        return false;
+
+    *nodes = data >> 8;
+    return true;
+}
+
+void perft_tt_save(U64 key, int depth, U64 nodes) {
+    if (!PERFT_ENTRIES)
+        return;
+
+    PerftEntry* entry = &PERFT_TABLE[key % PERFT_ENTRIES];
+    U64 data = nodes << 8 | depth;
+
+    __atomic_store_n(&entry->key, key ^ data, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
+}
+
+bool pawn_tt_probe(U64 key, int *score) {
+    PawnEntry* entry = &PAWN_TABLE[key & (PAWN_TT_ENTRIES - 1)];
+    U64 entry_key = __atomic_load_n(&entry->key, __ATOMIC_RELAXED);
+    U64 data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+
+    PAWN_PROBES++;
+    if ((entry_key ^ data) != key)
+        return false;
+
+    PAWN_HITS++;
+    *score = (int)(U32)data;
+    return true;
+}
+
+void pawn_tt_save(U64 key, int score) {
+    PawnEntry* entry = &PAWN_TABLE[key & (PAWN_TT_ENTRIES - 1)];
+    U64 data = (U32)score;
+
+    __atomic_store_n(&entry->key, key ^ data, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
+}
 
-    entry->key = key;
-    entry->depth = depth;
-    entry->score= score;
-    entry->best = best;
-    entry->type = type;
+void pawn_tt_clear() {
+    memset(PAWN_TABLE, 0, sizeof(PAWN_TABLE));
+}
+
+void pawn_tt_reset_stats() {
+    PAWN_PROBES = 0;
+    PAWN_HITS = 0;
+}
+
+// of the probes made by the calling thread since the last reset
+double pawn_tt_hit_rate() {
+    return PAWN_PROBES ? (double)PAWN_HITS / PAWN_PROBES : 0;
+}
+
+/*
+ * Material entries are shared like pawn entries. The data word holds
+ *
+ *   imbalance | phase << 32 | endgame << 40 | strong << 48 | MATERIAL_VALID
+ *
+ * where the valid bit keeps a zeroed slot from matching the bare kings key 0.
+ */
+bool material_tt_probe(U64 key, MaterialEntry *entry) {
+    PawnEntry* slot = &MATERIAL_TABLE[key & (MATERIAL_TT_ENTRIES - 1)];
+    U64 slot_key = __atomic_load_n(&slot->key, __ATOMIC_RELAXED);
+    U64 data = __atomic_load_n(&slot->data, __ATOMIC_RELAXED);
+
+    if ((slot_key ^ data) != key || !(data & MATERIAL_VALID))
+        return false;
+
+    entry->imbalance = (int)(U32)data;
+    entry->phase = (data >> 32) & 0xff;
+    entry->endgame = (data >> 40) & 0xff;
+    entry->strong = (data >> 48) & 1;
+    return true;
+}
+
+void material_tt_save(U64 key, MaterialEntry *entry) {
+    PawnEntry* slot = &MATERIAL_TABLE[key & (MATERIAL_TT_ENTRIES - 1)];
+    U64 data = (U32)entry->imbalance | (U64)entry->phase << 32 | (U64)entry->endgame << 40
+        | (U64)entry->strong << 48 | MATERIAL_VALID;
+
+    __atomic_store_n(&slot->key, key ^ data, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->data, data, __ATOMIC_RELAXED);
+}
+
+void material_tt_clear() {
+    memset(MATERIAL_TABLE, 0, sizeof(MATERIAL_TABLE));
 }
 
 U64 board_hash(Board* board) {
     U64 hash = 0ULL;
     U64 bb;
     Sq sq;
-    StateFlags state = board->state_stack[board->ply];
+    StateFlags state = board->history[board->ply].state;
 
     for (int i = 0; i < NUM_PIECES; i++) {
         for (int j = 0; j < NUM_COLORS; j++) {
@@ -110,6 +521,37 @@ U64 board_hash(Board* board) {
     return hash;
 }
 
+// Full recompute of the pawn key that make_move keeps up to date.
+U64 pawn_hash(Board* board) {
+    U64 hash = 0ULL;
+    U64 bb;
+
+    for (int j = 0; j < NUM_COLORS; j++) {
+        bb = board->pieces[PAWN_IDX] & board->colors[j];
+
+        while (bb)
+            hash ^= ZOBRIST_PIECE_SQ[PAWN_IDX][j][LOG2(pop_lsb(&bb))];
+    }
+
+    return hash;
+}
+
+// Full recompute of the material key that make_move keeps up to date.
+U64 material_hash(Board* board) {
+    U64 hash = 0ULL;
+    int count;
+
+    for (int i = 0; i < NUM_PIECES; i++) {
+        for (int j = 0; j < NUM_COLORS; j++) {
+            count = POP_COUNT(board->pieces[i] & board->colors[j]);
+            while (count--)
+                hash ^= ZOBRIST_MATERIAL[i][j][count];
+        }
+    }
+
+    return hash;
+}
+
 int mate_depth(int score) {
     if (abs(score) <= CHECKMATE_CP)
         return 0;
@@ -133,7 +575,7 @@ void print_tt(TTEntry* entry) {
     if (!entry) {
         printf("{ NULL }");
     } else {
-        printf("{ %lx - ", entry->key);
+        printf("{ ");
         if (entry->type == EMPTY_NODE) {
             printf("EMPTY");
         } else {
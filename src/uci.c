@@ -4,7 +4,11 @@
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
+#include "bitbase.h"
 #include "engine.h"
+#include "movegen.h"
+#include "nnue.h"
+#include "syzygy.h"
 #include "uci.h"
 #include "utils.h" // includes <stdio.h>
 
@@ -157,6 +161,25 @@ static void setoption(char** input) {
                 resize_engine_table(atoi(next_token(input)));
             }
             return;
+        } else if (has(input, "Threads")) {
+            if (has(input, "value")) {
+                set_engine_threads(atoi(next_token(input)));
+            }
+            return;
+        } else if (has(input, "EvalFile")) {
+            if (has(input, "value")) {
+                char* path = next_token(input);
+                if (set_engine_eval_file(path) && *path)
+                    printf("info string evaluation %s\n", nnue_enabled() ? path : "classic");
+            }
+            return;
+        } else if (has(input, "SyzygyPath")) {
+            if (has(input, "value")) {
+                char* path = next_token(input);
+                if (set_engine_syzygy_path(path) && TB_LARGEST)
+                    printf("info string found %d tablebases, up to %d pieces\n", tb_num_tables(), TB_LARGEST);
+            }
+            return;
         } else {
             consume_token(input);
         }
@@ -202,11 +225,23 @@ int uci(void) {
         ptr = read_str;
         while (*ptr != '\n' && *ptr != '\0') { // read by token
             if (has(&ptr, "uci")) {
-                printf("id name %s dev-%d-%s\nid author %s\nuciok\n", IDENTIFY_NAME, COMMIT_DATE, GIT_HASH, IDENTIFY_AUTHOR);
-                printf("option name Hash type spin default %d min 1 max 65536\n", DEFAULT_TT_SIZE);
+                // every option has to come before uciok
+                printf("id name %s dev-%d-%s\nid author %s\n"
+                        "option name Hash type spin default %d min 1 max 65536\n"
+                        "option name Threads type spin default %d min 1 max %d\n"
+                        "option name EvalFile type string default <empty>\n"
+                        "option name SyzygyPath type string default <empty>\n"
+                        "uciok\n",
+                        IDENTIFY_NAME, COMMIT_DATE, GIT_HASH, IDENTIFY_AUTHOR, DEFAULT_TT_SIZE, DEFAULT_THREADS, MAX_THREADS);
+                printf("info string slider attacks %s\n", slider_backend_name());
+                printf("info string nnue inference %s\n", nnue_backend_name());
+                printf("info string kpk bitbase generated in %.1lf ms\n", kpk_generation_time());
             } else if (has(&ptr, "isready")) {
                 printf("readyok\n");
                 break;
+            } else if (has(&ptr, "ucinewgame")) {
+                engine_new_game();
+                break;
             } else if (has(&ptr, "position")) {
                 position(&ptr);
                 break;
@@ -220,6 +255,24 @@ int uci(void) {
             } else if (has(&ptr, "stop")) {
                 stop();
                 break;
+            } else if (has(&ptr, "savehash")) {
+                char* path = next_token(&ptr);
+                if (save_engine_table(path))
+                    printf("info string saved hash to %s\n", path);
+                break;
+            } else if (has(&ptr, "loadhash")) {
+                char* path = next_token(&ptr);
+                if (load_engine_table(path))
+                    printf("info string loaded hash from %s\n", path);
+                break;
+            } else if (has(&ptr, "bench")) {
+                if (has(&ptr, "search"))
+                    bench_search();
+                else if (has(&ptr, "eval"))
+                    bench_eval();
+                else
+                    bench_perft();
+                break;
             } else if (has(&ptr, "d")) {
                 print_engine();
 
@@ -0,0 +1,685 @@
+#!/usr/bin/env python3
+"""
+Writes the KRvK & KPvK tables in tests/syzygy for the tablebase tests.
+
+The positions are solved by retrograde analysis and written in the Syzygy
+format the engine reads: Huffman coded symbols that expand to pairs, small
+blocks and sparse indexes so lookups walk between blocks, mapped DTZ values
+with narrow & wide maps and the DTZ side to move stored once per table.
+Run it with python3 tests/syzygy/make_fixtures.py and paste the printed
+checksums into test_tablebases when the tables change.
+"""
+
+import collections
+import heapq
+import os
+import struct
+
+OUT_DIR = os.path.dirname(os.path.abspath(__file__))
+
+WDL_MAGIC = bytes([0x71, 0xe8, 0x23, 0x5d])
+DTZ_MAGIC = bytes([0xd7, 0x66, 0x0c, 0xa5])
+
+FLAG_STM, FLAG_MAPPED, FLAG_WIN_PLIES, FLAG_LOSS_PLIES, FLAG_WIDE, FLAG_SINGLE = 1, 2, 4, 8, 16, 128
+
+W_PAWN, W_ROOK, W_KING, B_KING = 1, 4, 6, 14
+
+LOSS, DRAW, WIN = -2, 0, 2
+
+# ---------------------------------------------------------------- board rules
+
+
+def rank(s):
+    return s >> 3
+
+
+def file(s):
+    return s & 7
+
+
+def king_moves(s):
+    return [t for t in range(64) if t != s and abs(rank(t) - rank(s)) <= 1 and abs(file(t) - file(s)) <= 1]
+
+
+KING = [king_moves(s) for s in range(64)]
+KING_SET = [set(k) for k in KING]
+
+
+def adjacent(a, b):
+    return b in KING_SET[a]
+
+
+def rook_attacks(s, occ):
+    out = []
+    for dr, df in ((1, 0), (-1, 0), (0, 1), (0, -1)):
+        r, f = rank(s) + dr, file(s) + df
+        while 0 <= r < 8 and 0 <= f < 8:
+            t = r * 8 + f
+            out.append(t)
+            if t in occ:
+                break
+            r, f = r + dr, f + df
+    return out
+
+
+def queen_attacks(s, occ):
+    out = rook_attacks(s, occ)
+    for dr, df in ((1, 1), (1, -1), (-1, 1), (-1, -1)):
+        r, f = rank(s) + dr, file(s) + df
+        while 0 <= r < 8 and 0 <= f < 8:
+            t = r * 8 + f
+            out.append(t)
+            if t in occ:
+                break
+            r, f = r + dr, f + df
+    return out
+
+
+def pawn_attacks(p):
+    return [p + 8 + d for d in (-1, 1) if 0 <= file(p) + d < 8]
+
+
+# ------------------------------------------------------------------- solving
+
+
+def layer(white, black, white_moves, black_moves, white_zeroing, black_mated):
+    """
+    Distance to zeroing in plies of every decided position. white_moves and
+    black_moves give the positions reached without zeroing, white_zeroing
+    whether white has a winning capture, pawn move or mate, black_mated
+    whether black has no moves while in check. Black positions with a
+    drawing capture or no moves are left out by black_moves returning None.
+    """
+    dtz_w, dtz_b = {}, {}
+    succ_b = {b: black_moves(b) for b in black}
+    pred_b = collections.defaultdict(list)
+    pending = {}
+    for b, moves in succ_b.items():
+        if moves is None:
+            continue
+        pending[b] = len(moves)
+        for w in moves:
+            pred_b[w].append(b)
+
+    pred_w = collections.defaultdict(list)
+    for w in white:
+        for b in white_moves(w):
+            pred_w[b].append(w)
+
+    frontier_w = [w for w in white if white_zeroing(w)]
+    frontier_b = [b for b in black if black_mated(b)]
+    for b in frontier_b:
+        dtz_b[b] = 1
+    for b in frontier_b:
+        for w in pred_w[b]:
+            if w not in dtz_w:
+                dtz_w[w] = 1
+                frontier_w.append(w)
+    for w in frontier_w:
+        dtz_w[w] = 1
+
+    plies = 1
+    while frontier_w:
+        next_b = []
+        for w in frontier_w:
+            for b in pred_b[w]:
+                if b in pending:
+                    pending[b] -= 1
+                    if not pending[b] and b not in dtz_b:
+                        dtz_b[b] = plies + 1
+                        next_b.append(b)
+        next_w = []
+        for b in next_b:
+            for w in pred_w[b]:
+                if w not in dtz_w:
+                    dtz_w[w] = plies + 2
+                    next_w.append(w)
+        frontier_w = next_w
+        plies += 2
+
+    return dtz_w, dtz_b
+
+
+def solve_krk():
+    """Keys are (wk, wr, bk), values the DTZ of the side to move, 0 for draws."""
+    white, black = [], []
+    for wk in range(64):
+        for wr in range(64):
+            for bk in range(64):
+                if len({wk, wr, bk}) < 3 or adjacent(wk, bk):
+                    continue
+                black.append((wk, wr, bk))
+                if bk not in rook_attacks(wr, {wk, bk}):
+                    white.append((wk, wr, bk))
+    white_set = set(white)
+
+    def white_moves(w):
+        wk, wr, bk = w
+        out = [(t, wr, bk) for t in KING[wk] if t != wr and not adjacent(t, bk)]
+        out += [(wk, t, bk) for t in rook_attacks(wr, {wk, bk}) if t not in (wk, bk)]
+        return out
+
+    def black_legal(b):
+        wk, wr, bk = b
+        out = []
+        for t in KING[bk]:
+            if adjacent(t, wk):
+                continue
+            if t == wr:
+                out.append(None)  # captures the rook, a draw
+            elif t not in rook_attacks(wr, {wk, t}):
+                out.append((wk, wr, t))
+        return out
+
+    def in_check(b):
+        return b[2] in rook_attacks(b[1], {b[0], b[2]})
+
+    def black_moves(b):
+        moves = black_legal(b)
+        if not moves or None in moves:
+            return None
+        return moves
+
+    dtz_w, dtz_b = layer(white, black, white_moves, black_moves,
+                         lambda w: False, lambda b: not black_legal(b) and in_check(b))
+    assert len(dtz_w) == len(white_set)
+    return {w: dtz_w.get(w, 0) for w in white}, {b: -dtz_b.get(b, 0) for b in black}
+
+
+def promotion_wins(p, wk, bk):
+    """Whether a queen or rook on p with black to move wins."""
+    for attacks in (queen_attacks, rook_attacks):
+        moves, check = 0, bk in attacks(p, {wk, bk})
+        hangs = adjacent(bk, p) and not adjacent(wk, p)
+        for t in KING[bk]:
+            if t != p and not adjacent(t, wk) and t not in attacks(p, {wk, t}):
+                moves += 1
+        if not hangs and (moves or check):
+            return True
+    return False
+
+
+def solve_kpk():
+    """Keys are (p, wk, bk), values the DTZ of the side to move, 0 for draws."""
+    all_w, all_b = {}, {}
+    for r in range(6, 0, -1):
+        for f in range(8):
+            p = r * 8 + f
+            white, black = [], []
+            for wk in range(64):
+                for bk in range(64):
+                    if len({p, wk, bk}) < 3 or adjacent(wk, bk):
+                        continue
+                    black.append((p, wk, bk))
+                    if bk not in pawn_attacks(p):
+                        white.append((p, wk, bk))
+
+            def white_moves(w):
+                p, wk, bk = w
+                return [(p, t, bk) for t in KING[wk] if t != p and not adjacent(t, bk)]
+
+            def white_zeroing(w):
+                p, wk, bk = w
+                if p + 8 in (wk, bk):
+                    return False
+                if rank(p) == 6:
+                    return promotion_wins(p + 8, wk, bk)
+                if all_b[(p + 8, wk, bk)] < 0:
+                    return True
+                return rank(p) == 1 and p + 16 not in (wk, bk) and all_b[(p + 16, wk, bk)] < 0
+
+            def black_legal(b):
+                p, wk, bk = b
+                out = []
+                for t in KING[bk]:
+                    if adjacent(t, wk) or t in pawn_attacks(p):
+                        continue
+                    out.append(None if t == p else (p, wk, t))
+                return out
+
+            def black_moves(b):
+                moves = black_legal(b)
+                if not moves or None in moves:
+                    return None
+                return moves
+
+            dtz_w, dtz_b = layer(white, black, white_moves, black_moves, white_zeroing,
+                                 lambda b: not black_legal(b) and b[2] in pawn_attacks(b[0]))
+            for w in white:
+                all_w[w] = dtz_w.get(w, 0)
+            for b in black:
+                all_b[b] = -dtz_b.get(b, 0)
+    return all_w, all_b
+
+
+# ------------------------------------------------------------------ indexing
+
+
+def off_diagonal(s):
+    return rank(s) - file(s)
+
+
+MAP_B1H1H7 = [0] * 64
+MAP_A1D1D4 = [0] * 64
+
+
+def init_maps():
+    code = 0
+    for s in range(64):
+        if off_diagonal(s) < 0:
+            MAP_B1H1H7[s] = code
+            code += 1
+    code, diagonal = 0, []
+    for s in (0, 1, 2, 3, 8, 9, 10, 11, 16, 17, 18, 19, 24, 25, 26, 27):
+        if off_diagonal(s) < 0:
+            MAP_A1D1D4[s] = code
+            code += 1
+        elif not off_diagonal(s):
+            diagonal.append(s)
+    for s in diagonal:
+        MAP_A1D1D4[s] = code
+        code += 1
+
+
+init_maps()
+
+
+def group_multipliers(sizes, order):
+    """Multiplier of each group, the leading group placed at position order."""
+    mult, idx, nxt = [0] * len(sizes), 1, 1
+    for k in range(len(sizes)):
+        g = 0 if k == order else nxt
+        nxt += k != order
+        mult[g] = idx
+        idx *= sizes[g]
+    return mult
+
+
+def unique_index(sq):
+    """Index of three unique pieces in table order, before group multipliers."""
+    sq = list(sq)
+    if file(sq[0]) > 3:
+        sq = [s ^ 7 for s in sq]
+    if rank(sq[0]) > 3:
+        sq = [s ^ 56 for s in sq]
+    for i in range(3):
+        if not off_diagonal(sq[i]):
+            continue
+        if off_diagonal(sq[i]) > 0:
+            for j in range(i, 3):
+                sq[j] = ((sq[j] >> 3) | (sq[j] << 3)) & 63
+        break
+    a1 = int(sq[1] > sq[0])
+    a2 = int(sq[2] > sq[0]) + int(sq[2] > sq[1])
+    if off_diagonal(sq[0]):
+        return (MAP_A1D1D4[sq[0]] * 63 + (sq[1] - a1)) * 62 + sq[2] - a2
+    if off_diagonal(sq[1]):
+        return (6 * 63 + rank(sq[0]) * 28 + MAP_B1H1H7[sq[1]]) * 62 + sq[2] - a2
+    if off_diagonal(sq[2]):
+        return 6 * 63 * 62 + 4 * 28 * 62 + rank(sq[0]) * 7 * 28 + (rank(sq[1]) - a1) * 28 + MAP_B1H1H7[sq[2]]
+    return 6 * 63 * 62 + 4 * 28 * 62 + 4 * 7 * 28 + rank(sq[0]) * 7 * 6 + (rank(sq[1]) - a1) * 6 + rank(sq[2]) - a2
+
+
+def pawn_index(sq, mult):
+    """Index & file of a single leading pawn followed by two single pieces."""
+    sq = list(sq)
+    if file(sq[0]) > 3:
+        sq = [s ^ 7 for s in sq]
+    n1 = sq[1] - int(sq[1] > sq[0])
+    n2 = sq[2] - int(sq[2] > sq[0]) - int(sq[2] > sq[1])
+    return (rank(sq[0]) - 1) * mult[0] + n1 * mult[1] + n2 * mult[2], file(sq[0])
+
+
+# --------------------------------------------------------------- compression
+
+
+class Pairs:
+    """One compressed run of values, a PairsData in the engine."""
+
+    def __init__(self, values, block_log, span_log):
+        self.values = values
+        self.block_log = block_log
+        self.span_log = span_log
+        self.flags = 0
+
+    def compress(self):
+        distinct = sorted(set(self.values))
+        if len(distinct) == 1:
+            self.flags |= FLAG_SINGLE
+            return
+
+        # symbols are (value,) leaves or (left, right) pairs of symbols
+        syms = [(v,) for v in distinct]
+        expand = [1] * len(syms)
+        seq = [distinct.index(v) for v in self.values]
+        while len(syms) < 240:
+            counts = collections.Counter(
+                (a, b) for a, b in zip(seq, seq[1:]) if expand[a] + expand[b] <= 256)
+            if not counts:
+                break
+            (a, b), n = counts.most_common(1)[0]
+            if n < 16:
+                break
+            syms.append((a, b))
+            expand.append(expand[a] + expand[b])
+            new, out, i = len(syms) - 1, [], 0
+            while i < len(seq):
+                if i + 1 < len(seq) and seq[i] == a and seq[i + 1] == b:
+                    out.append(new)
+                    i += 2
+                else:
+                    out.append(seq[i])
+                    i += 1
+            seq = out
+
+        # every symbol gets a code so the canonical code stays complete
+        freq = collections.Counter(seq)
+        heap = [(freq[s] + 1, s, [s]) for s in range(len(syms))]
+        heapq.heapify(heap)
+        length = [0] * len(syms)
+        tie = len(syms)
+        while len(heap) > 1:
+            f1, _, s1 = heapq.heappop(heap)
+            f2, _, s2 = heapq.heappop(heap)
+            for s in s1 + s2:
+                length[s] += 1
+            heapq.heappush(heap, (f1 + f2, tie, s1 + s2))
+            tie += 1
+
+        # longer codes get the lower symbol numbers
+        order = sorted(range(len(syms)), key=lambda s: (-length[s], s))
+        renum = {s: i for i, s in enumerate(order)}
+        self.min_len, self.max_len = min(length), max(length)
+        assert self.max_len <= 32
+        num_lengths = self.max_len - self.min_len + 1
+        count = [0] * num_lengths
+        for s in range(len(syms)):
+            count[length[s] - self.min_len] += 1
+        self.lowest_sym = [0] * num_lengths
+        base = [0] * num_lengths
+        for i in range(num_lengths - 2, -1, -1):
+            self.lowest_sym[i] = self.lowest_sym[i + 1] + count[i + 1]
+            assert (base[i + 1] + count[i + 1]) % 2 == 0
+            base[i] = (base[i + 1] + count[i + 1]) // 2
+        assert base[0] + count[0] == 1 << self.min_len
+
+        self.btree = []
+        for s in order:
+            if len(syms[s]) == 1:
+                self.btree.append((syms[s][0], 0xfff))
+            else:
+                self.btree.append((renum[syms[s][0]], renum[syms[s][1]]))
+
+        def code(s):
+            i = length[s] - self.min_len
+            return base[i] + renum[s] - self.lowest_sym[i], length[s]
+
+        # whole symbols per block, at most 65536 values each
+        capacity = 8 << self.block_log
+        self.blocks, self.block_values = [], []
+        bits, used, values = [], 0, 0
+        for s in seq:
+            c, n = code(s)
+            if used + n > capacity or values + expand[s] > 65536:
+                self.blocks.append(bits)
+                self.block_values.append(values)
+                bits, used, values = [], 0, 0
+            bits.append((c, n))
+            used += n
+            values += expand[s]
+        self.blocks.append(bits)
+        self.block_values.append(values)
+
+        # block & offset of the middle value of every span
+        span = 1 << self.span_log
+        starts, total = [], 0
+        for v in self.block_values:
+            starts.append(total)
+            total += v
+        assert total == len(self.values)
+        self.sparse = []
+        block = 0
+        for k in range((len(self.values) + span - 1) // span):
+            idx = k * span + span // 2
+            while block + 1 < len(starts) and starts[block + 1] <= idx:
+                block += 1
+            assert idx - starts[block] < 65536
+            self.sparse.append((block, idx - starts[block]))
+
+    def sizes(self):
+        if self.flags & FLAG_SINGLE:
+            return bytes([self.flags, self.values[0]])
+        out = bytes([self.flags, self.block_log, self.span_log, 0])
+        out += struct.pack('<I', len(self.blocks))
+        out += bytes([self.max_len, self.min_len])
+        out += b''.join(struct.pack('<H', s) for s in self.lowest_sym)
+        out += struct.pack('<H', len(self.btree))
+        for left, right in self.btree:
+            out += bytes([left & 0xff, ((left >> 8) & 0xf) | ((right & 0xf) << 4), right >> 4])
+        if len(self.btree) & 1:
+            out += b'\0'
+        return out
+
+    def sparse_index(self):
+        if self.flags & FLAG_SINGLE:
+            return b''
+        return b''.join(struct.pack('<IH', b, o) for b, o in self.sparse)
+
+    def block_lengths(self):
+        if self.flags & FLAG_SINGLE:
+            return b''
+        return b''.join(struct.pack('<H', v - 1) for v in self.block_values)
+
+    def data(self):
+        if self.flags & FLAG_SINGLE:
+            return b''
+        out = b''
+        for bits in self.blocks:
+            acc, n = 0, 0
+            for c, length in bits:
+                acc, n = (acc << length) | c, n + length
+            size = 1 << self.block_log
+            acc <<= size * 8 - n
+            out += acc.to_bytes(size, 'big')
+        return out
+
+
+def dtz_map(pairs, raw, wdl, wide):
+    """Replaces raw DTZ values by their rank in the map of their result."""
+    maps = [[], [], [], []]  # WIN, LOSS, CURSED_WIN, BLESSED_LOSS
+    which = {WIN: 0, LOSS: 1}
+    for slot in (0, 1):
+        counts = collections.Counter(r for r, w in zip(raw, wdl) if w is not None and which[w] == slot)
+        maps[slot] = sorted(counts, key=lambda r: (-counts[r], r))
+    values, last = [], 0
+    for r, w in zip(raw, wdl):
+        if w is not None:
+            last = maps[which[w]].index(r)
+        values.append(last)
+    pairs.values = values
+    pairs.flags |= FLAG_MAPPED | (FLAG_WIDE if wide else 0)
+    return maps
+
+
+def fill(values):
+    """Gives positions the table never answers the value before them."""
+    out, last = [], None
+    first = next(v for v in values if v is not None)
+    for v in values:
+        last = v if v is not None else (last if last is not None else first)
+        out.append(last)
+    return out
+
+
+def write_table(name, dtz, flags, files, maps):
+    """
+    files holds per file the order byte, the piece bytes and the Pairs of each
+    side, maps the DTZ maps & widths of each file.
+    """
+    out = bytearray((DTZ_MAGIC if dtz else WDL_MAGIC) + bytes([flags]))
+    for order, pieces, _ in files:
+        out += bytes([order]) + bytes(pieces)
+    if len(out) & 1:
+        out += b'\0'
+    for _, _, sides in files:
+        for d in sides:
+            d.compress()
+    for _, _, sides in files:
+        for d in sides:
+            out += d.sizes()
+    if dtz:
+        for (m, wide), (_, _, sides) in zip(maps, files):
+            if not sides[0].flags & FLAG_MAPPED:
+                continue
+            if wide:
+                if len(out) & 1:
+                    out += b'\0'
+                for entries in m:
+                    out += struct.pack('<H', len(entries)) + b''.join(struct.pack('<H', e) for e in entries)
+            else:
+                for entries in m:
+                    out += bytes([len(entries)] + entries)
+        if len(out) & 1:
+            out += b'\0'
+    for _, _, sides in files:
+        for d in sides:
+            out += d.sparse_index()
+    for _, _, sides in files:
+        for d in sides:
+            out += d.block_lengths()
+    for _, _, sides in files:
+        for d in sides:
+            out += bytes(-len(out) % 64)
+            out += d.data()
+    out += bytes(-len(out) % 64)
+    out += bytes(range(16))  # stands in for the checksum of real tables
+    with open(os.path.join(OUT_DIR, name), 'wb') as f:
+        f.write(out)
+    return len(out)
+
+
+# -------------------------------------------------------------------- tables
+
+
+def wdl_of(dtz):
+    return WIN if dtz > 0 else LOSS if dtz < 0 else DRAW
+
+
+def write_krk(dtz_w, dtz_b):
+    size = 31332
+    # side 0 white to move as wK wR bK, side 1 black to move as wR wK bK
+    wdl = [[None] * size, [None] * size]
+    dtz = [None] * size
+    for stm, table, order in ((0, dtz_w, lambda k, r, b: (k, r, b)), (1, dtz_b, lambda k, r, b: (r, k, b))):
+        for (wk, wr, bk), v in table.items():
+            idx = unique_index(order(wk, wr, bk))
+            assert wdl[stm][idx] in (None, wdl_of(v) + 2)
+            wdl[stm][idx] = wdl_of(v) + 2
+            if stm:
+                assert dtz[idx] in (None, v)
+                dtz[idx] = v
+
+    pieces = [(W_ROOK << 4) | W_KING, (W_KING << 4) | W_ROOK, (B_KING << 4) | B_KING]
+    sides = [Pairs(fill(wdl[0]), 6, 8), Pairs(fill(wdl[1]), 6, 8)]
+    n = write_table('KRvK.rtbw', False, 1, [(0x00, pieces, sides)], None)
+    print('KRvK.rtbw', n, 'bytes')
+
+    # DTZ stores black to move in plies, the mated position as 0, with the
+    # pieces in the order of the black to move WDL table
+    raw = [-v - 1 if v else None for v in dtz]
+    d = Pairs(None, 6, 7)
+    m = dtz_map(d, [r or 0 for r in raw], [LOSS if r is not None else None for r in raw], False)
+    d.flags |= FLAG_STM | FLAG_LOSS_PLIES
+    n = write_table('KRvK.rtbz', True, 1, [(0x00, [W_ROOK, W_KING, B_KING], [d])], [(m, False)])
+    print('KRvK.rtbz', n, 'bytes')
+
+
+def write_kpk(dtz_w, dtz_b):
+    sizes = [6, 63, 62]
+    # the pawn group goes first for white to move, last for black to move
+    mult = [group_multipliers(sizes, 0), group_multipliers(sizes, 2)]
+    size = 6 * 63 * 62
+    wdl = [[[None] * size for _ in range(4)] for _ in range(2)]
+    dtz = [[None] * size for _ in range(4)]
+    for stm, table in ((0, dtz_w), (1, dtz_b)):
+        for (p, wk, bk), v in table.items():
+            idx, f = pawn_index((p, wk, bk), mult[stm])
+            assert wdl[stm][f][idx] in (None, wdl_of(v) + 2)
+            wdl[stm][f][idx] = wdl_of(v) + 2
+            if not stm:
+                idx, f = pawn_index((p, wk, bk), mult[0])
+                assert dtz[f][idx] in (None, v)
+                dtz[f][idx] = v
+
+    pieces = [(W_PAWN << 4) | W_PAWN, (W_KING << 4) | W_KING, (B_KING << 4) | B_KING]
+    files = [(0x20, pieces, [Pairs(fill(wdl[0][f]), 6, 8), Pairs(fill(wdl[1][f]), 7, 9)]) for f in range(4)]
+    n = write_table('KPvK.rtbw', False, 3, files, None)
+    print('KPvK.rtbw', n, 'bytes')
+
+    # DTZ stores white to move in moves, files a & c with wide maps
+    files, maps = [], []
+    for f in range(4):
+        raw = [(v - 1) // 2 if v else None for v in dtz[f]]
+        d = Pairs(None, 6, 8)
+        m = dtz_map(d, [r or 0 for r in raw], [WIN if r is not None else None for r in raw], f % 2 == 0)
+        files.append((0x00, [W_PAWN, W_KING, B_KING], [d]))
+        maps.append((m, f % 2 == 0))
+    n = write_table('KPvK.rtbz', True, 3, files, maps)
+    print('KPvK.rtbz', n, 'bytes')
+
+
+# --------------------------------------------------------------- checksums
+
+
+def checksum(positions):
+    """Order dependent sum of (wdl, dtz) matching test_tablebases."""
+    h = 0
+    for wdl, dtz in positions:
+        h = (h * 31 + (wdl + 2) * 1000 + dtz + 500) & 0xffffffffffffffff
+    return h
+
+
+def krk_checksum(dtz_w, dtz_b):
+    # white king in the a1-d1-d4 triangle, rook & black king anywhere
+    out = []
+    for stm in (0, 1):
+        for wk in (0, 1, 2, 3, 9, 10, 11, 18, 19, 27):
+            for wr in range(64):
+                for bk in range(64):
+                    table = dtz_b if stm else dtz_w
+                    if (wk, wr, bk) in table:
+                        v = table[(wk, wr, bk)]
+                        out.append((wdl_of(v), v))
+    return checksum(out), len(out)
+
+
+def kpk_checksum(dtz_w, dtz_b):
+    # pawn on files a-d & ranks 2-6, no promotion is ever searched
+    out = []
+    for stm in (0, 1):
+        for p in range(8, 48):
+            if file(p) > 3:
+                continue
+            for wk in range(64):
+                for bk in range(64):
+                    table = dtz_b if stm else dtz_w
+                    if (p, wk, bk) in table:
+                        v = table[(p, wk, bk)]
+                        out.append((wdl_of(v), v))
+    return checksum(out), len(out)
+
+
+def main():
+    krk_w, krk_b = solve_krk()
+    print('KRvK longest win', max(krk_w.values()), 'longest loss', min(krk_b.values()))
+    write_krk(krk_w, krk_b)
+    print('KRvK checksum 0x%016xULL over %d positions' % krk_checksum(krk_w, krk_b))
+
+    kpk_w, kpk_b = solve_kpk()
+    print('KPvK longest win', max(kpk_w.values()), 'longest loss', min(kpk_b.values()))
+    write_kpk(kpk_w, kpk_b)
+    print('KPvK checksum 0x%016xULL over %d positions' % kpk_checksum(kpk_w, kpk_b))
+
+
+if __name__ == '__main__':
+    main()
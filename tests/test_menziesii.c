@@ -1,22 +1,33 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include "bitbase.h"
 #include "board.h"
 #include "table.h"
 #include "types.h"
 #include "eval.h"
 #include "movegen.h"
+#include "nnue.h"
+#include "syzygy.h"
 #include "utils.h"
 
+#define TT_STRESS_THREADS 8
+#define TT_STRESS_ITERATIONS 200000
+
 static int TESTS_RUN;
 static int TESTS_PASSED;
 static bool PERFTS_PASSED;
 static U64 PERFT_NODES;
+static int TT_CORRUPTED_READS;
 
 static bool is_move(Move move, Board *board) {
-    Move *curr = (Move[256]){0};
-    Move *end = legal_moves(board, curr);
+    ScoredMove *curr = (ScoredMove[256]){0};
+    ScoredMove *end = legal_moves(board, curr);
 
     while (curr < end) {
-        if (*curr == move)
+        if (curr->move == move)
             return true;
 
         curr++;
@@ -65,17 +76,61 @@ static void assert_perft(char* fen, int depth, U64 expected) {
     free(board);
 }
 
+// the stages must partition the legal moves, and is_legal must agree with the
+// generated list for every possible 16-bit move
+static void assert_staged_moves(char* fen) {
+    Board *board = from_fen(fen);
+    ScoredMove *all = (ScoredMove[256]){0};
+    ScoredMove *staged = (ScoredMove[256]){0};
+    ScoredMove *all_end = legal_moves(board, all);
+    ScoredMove *staged_end;
+    ScoredMove *curr;
+    int i, found;
+    bool passed = true;
+
+    TESTS_RUN++;
+
+    if (is_in_check(board)) {
+        staged_end = evasion_moves(board, staged);
+    } else {
+        staged_end = capture_moves(board, staged);
+        staged_end = quiet_moves(board, staged_end);
+    }
+
+    passed = (all_end - all) == (staged_end - staged)
+        && count_legal_moves(board) == all_end - all;
+
+    for (i = 0; i <= 0xffff && passed; i++) {
+        found = 0;
+        for (curr = staged; curr < staged_end; curr++)
+            found += curr->move == i;
+
+        if (found > 1 || is_legal(board, i) != found)
+            passed = false;
+    }
+
+    if (passed) {
+        TESTS_PASSED++;
+    } else {
+        printf("STAGED MOVE GENERATION ASSERTION FAILED\nFEN       %s\nMOVE      ", fen);
+        print_move(i - 1);
+        printf("\n");
+    }
+
+    free(board);
+}
+
 static void assert_eval(char* fen, int depth, int upper_bound, int lower_bound) {
     Board *board = from_fen(fen);
     eval(board, depth);
-    TTEntry* entry = tt_probe(get_hash(board));
+    TTEntry entry;
     int actual = upper_bound;
     TESTS_RUN++;
-    if (!entry) {
+    if (!tt_probe(get_hash(board), &entry)) {
         printf("ERROR READING ENTRY IN EVAL ASSERTION\n");
         TESTS_PASSED--;
     } else {
-        actual = entry->score;
+        actual = entry.score;
     }
 
     if ((lower_bound <= actual) && (actual <= upper_bound)) {
@@ -90,18 +145,18 @@ static void assert_eval(char* fen, int depth, int upper_bound, int lower_bound)
 static void assert_mate(char* fen, int in) {
     Board *board = from_fen(fen);
     eval(board, in*2+2);
-    TTEntry* entry = tt_probe(get_hash(board));
+    TTEntry entry;
     TESTS_RUN++;
 
-    if (!entry) {
+    if (!tt_probe(get_hash(board), &entry)) {
         printf("MATE ASSERTION FAILED - NO TRANSPOSITION TABLE ENTRY\n");
-    } else if (mate_score(entry) == in) {
+    } else if (mate_score(entry.score) == in) {
         TESTS_PASSED++;
     } else {
-        if (abs(entry->score) <= CHECKMATE_CP) {
-            printf("MATE ASSERTION FAILED - NOT MATE\nFEN       %s\nACTUAL    %d cp\nDEPTH     %d\n", fen, entry->score, entry->depth);
+        if (abs(entry.score) <= CHECKMATE_CP) {
+            printf("MATE ASSERTION FAILED - NOT MATE\nFEN       %s\nACTUAL    %d cp\nDEPTH     %d\n", fen, entry.score, entry.depth);
         } else {
-            printf("MATE ASSERTION FAILED - INCORRECT DEPTH\nFEN       %s\nEXPECTED  %d\nACTUAL    %d\n", fen, in, mate_score(entry));
+            printf("MATE ASSERTION FAILED - INCORRECT DEPTH\nFEN       %s\nEXPECTED  %d\nACTUAL    %d\n", fen, in, mate_score(entry.score));
         }
 
     }
@@ -109,6 +164,259 @@ static void assert_mate(char* fen, int in) {
     free(board);
 }
 
+// plays random games and checks the incremental balance after every move
+static void assert_incremental_psq(char* fen, int games) {
+    Board *board = from_fen(fen);
+    Move moves[256];
+    bool passed = board->history[0].psq == board_psq(board) && board->material_key == material_hash(board);
+    passed = passed && board->pawn_key == pawn_hash(board);
+    int i, j;
+
+    TESTS_RUN++;
+
+    for (i = 0; i < games && passed; i++) {
+        for (j = 0; j < 256 && (moves[j] = random_move(board)); j++) {
+            make_move(board, moves[j]);
+            passed = passed && board->history[board->ply].psq == board_psq(board);
+            passed = passed && board->material_key == material_hash(board);
+            passed = passed && board->pawn_key == pawn_hash(board);
+        }
+
+        while (j--) {
+            unmake_move(board, moves[j]);
+            passed = passed && board->history[board->ply].psq == board_psq(board);
+            passed = passed && board->material_key == material_hash(board);
+            passed = passed && board->pawn_key == pawn_hash(board);
+        }
+    }
+
+    if (passed) {
+        TESTS_PASSED++;
+    } else {
+        printf("INCREMENTAL PSQ ASSERTION FAILED\nFEN       %s\nEXPECTED  %d\nACTUAL    %d\n", fen, board_psq(board), board->history[board->ply].psq);
+    }
+
+    free_board(board);
+}
+
+// accumulators kept by make_move must match a refresh, and every backend must
+// produce the same evaluation from them
+static void assert_incremental_nnue(char* fen, int games) {
+    Board *board = from_fen(fen);
+    Accumulator fresh;
+    Move moves[256];
+    bool passed = true;
+    int i, j, scalar = 0, avx2 = 0;
+
+    TESTS_RUN++;
+    nnue_attach(board);
+
+    for (i = 0; i < games && passed; i++) {
+        set_nnue_backend(i % 2 ? NNUE_SCALAR : best_nnue_backend());
+        for (j = 0; j < 256 && passed && (moves[j] = random_move(board)); j++) {
+            make_move(board, moves[j]);
+            nnue_refresh(board, &fresh);
+            passed = !memcmp(board->acc, &fresh, sizeof(Accumulator));
+
+            set_nnue_backend(NNUE_SCALAR);
+            scalar = nnue_evaluate(board);
+            set_nnue_backend(best_nnue_backend());
+            avx2 = nnue_evaluate(board);
+            passed = passed && scalar == avx2;
+            set_nnue_backend(i % 2 ? NNUE_SCALAR : best_nnue_backend());
+        }
+
+        while (j--) {
+            unmake_move(board, moves[j]);
+            nnue_refresh(board, &fresh);
+            passed = passed && !memcmp(board->acc, &fresh, sizeof(Accumulator));
+        }
+    }
+
+    if (passed) {
+        TESTS_PASSED++;
+    } else {
+        printf("INCREMENTAL NNUE ASSERTION FAILED\nFEN       %s\nSCALAR    %d\n%-10s%d\n", fen, scalar, nnue_backend_name(), avx2);
+    }
+
+    set_nnue_backend(best_nnue_backend());
+    free_board(board);
+}
+
+// the pawn structure of fen must score eg_sign for white, and the exact
+// opposite once the colours are swapped in mirrored
+static void assert_pawn_eval(char* fen, char* mirrored, int eg_sign) {
+    Board *board = from_fen(fen);
+    Board *flipped = from_fen(mirrored);
+    int score = pawn_eval(board);
+    bool passed = score == -pawn_eval(flipped);
+
+    TESTS_RUN++;
+    passed = passed && (eg_value(score) > 0) - (eg_value(score) < 0) == eg_sign;
+
+    if (passed) {
+        TESTS_PASSED++;
+    } else {
+        printf("PAWN EVAL ASSERTION FAILED\nFEN       %s\nWHITE     %d %d\nMIRRORED  %d %d\n", fen,
+                mg_value(score), eg_value(score), mg_value(pawn_eval(flipped)), eg_value(pawn_eval(flipped)));
+    }
+
+    free_board(board);
+    free_board(flipped);
+}
+
+static void assert_endgame(char* fen, int endgame) {
+    Board *board = from_fen(fen);
+    MaterialEntry entry;
+
+    TESTS_RUN++;
+    material_eval(board, &entry);
+
+    if (entry.endgame == endgame) {
+        TESTS_PASSED++;
+    } else {
+        printf("ENDGAME ASSERTION FAILED\nFEN       %s\nEXPECTED  %d\nACTUAL    %d\n", fen, endgame, entry.endgame);
+    }
+
+    free_board(board);
+}
+
+static void assert_kpk(char* fen, bool win) {
+    Board *board = from_fen(fen);
+
+    TESTS_RUN++;
+
+    if (kpk_probe(board) == win) {
+        TESTS_PASSED++;
+    } else {
+        printf("KPK ASSERTION FAILED\nFEN       %s\nEXPECTED  %s\n", fen, win ? "win" : "draw");
+    }
+
+    free_board(board);
+}
+
+static void assert_wdl(char* fen, int expected) {
+    Board *board = from_fen(fen);
+    int wdl;
+
+    TESTS_RUN++;
+
+    if (tb_probe_wdl(board, &wdl) && wdl == expected) {
+        TESTS_PASSED++;
+    } else {
+        printf("WDL ASSERTION FAILED\nFEN       %s\nEXPECTED  %d\n", fen, expected);
+    }
+
+    free_board(board);
+}
+
+static void assert_dtz(char* fen, int expected) {
+    Board *board = from_fen(fen);
+    int dtz;
+
+    TESTS_RUN++;
+
+    if (tb_probe_dtz(board, &dtz) && dtz == expected) {
+        TESTS_PASSED++;
+    } else {
+        printf("DTZ ASSERTION FAILED\nFEN       %s\nEXPECTED  %d\nACTUAL    %d\n", fen, expected, dtz);
+    }
+
+    free_board(board);
+}
+
+// the kings and one white piece, squares from a1
+static void three_piece_fen(char* fen, Sq wk, char piece, Sq sq, Sq bk, bool black) {
+    char squares[NUM_SQUARES] = {0};
+    int rank, file, empty, len = 0;
+
+    squares[wk] = 'K';
+    squares[sq] = piece;
+    squares[bk] = 'k';
+    for (rank = 7; rank >= 0; rank--) {
+        for (file = 0, empty = 0; file < 8; file++) {
+            if (!squares[rank * 8 + file]) {
+                empty++;
+                continue;
+            }
+            if (empty)
+                fen[len++] = '0' + empty;
+            fen[len++] = squares[rank * 8 + file];
+            empty = 0;
+        }
+        if (empty)
+            fen[len++] = '0' + empty;
+        if (rank)
+            fen[len++] = '/';
+    }
+    sprintf(fen + len, " %c - - 0 1", black ? 'b' : 'w');
+}
+
+/*
+ * Folds the WDL & DTZ of every legal position of the kings and a white piece
+ * into the checksum tests/syzygy/make_fixtures.py prints, white to move
+ * first. The leading piece walks the given squares, the other white piece and
+ * the black king the whole board.
+ */
+static void assert_tb_checksum(char piece, bool king_leads, const Sq* leading, int num_leading, U64 expected, int expected_count) {
+    char fen[96];
+    Sq wk, sq, bk;
+    U64 checksum = 0, attacks;
+    int black, i, j, wdl, dtz, count = 0;
+    bool probed = true;
+
+    TESTS_RUN++;
+
+    for (black = false; black <= true; black++) {
+        for (i = 0; i < num_leading; i++) {
+            for (j = 0; j < NUM_SQUARES; j++) {
+                for (bk = 0; bk < NUM_SQUARES; bk++) {
+                    wk = king_leads ? leading[i] : j;
+                    sq = king_leads ? j : leading[i];
+                    if (wk == sq || wk == bk || sq == bk || (k_moves(1ULL << wk) & (1ULL << bk)))
+                        continue;
+
+                    attacks = piece == 'R' ? r_moves(1ULL << sq, (1ULL << wk) | (1ULL << bk))
+                        : nort_one(east_one(1ULL << sq) | west_one(1ULL << sq));
+                    if (!black && (attacks & (1ULL << bk)))
+                        continue;
+
+                    three_piece_fen(fen, wk, piece, sq, bk, black);
+                    Board *board = from_fen(fen);
+                    probed = probed && tb_probe_wdl(board, &wdl) && tb_probe_dtz(board, &dtz);
+                    checksum = checksum * 31 + (wdl + 2) * 1000 + dtz + 500;
+                    count++;
+                    free_board(board);
+                }
+            }
+        }
+    }
+
+    if (probed && checksum == expected && count == expected_count) {
+        TESTS_PASSED++;
+    } else {
+        printf("TABLEBASE CHECKSUM ASSERTION FAILED\nTABLE     K%cvK\nEXPECTED  %016lx over %d\nACTUAL    %016lx over %d\n",
+                piece, expected, expected_count, checksum, count);
+    }
+}
+
+// the side to move in better must be evaluated above the one in worse
+static void assert_eval_order(char* better, char* worse) {
+    Board *b1 = from_fen(better);
+    Board *b2 = from_fen(worse);
+
+    TESTS_RUN++;
+
+    if (piece_eval(b1) > piece_eval(b2)) {
+        TESTS_PASSED++;
+    } else {
+        printf("EVAL ORDER ASSERTION FAILED\nBETTER    %s %d\nWORSE     %s %d\n", better, piece_eval(b1), worse, piece_eval(b2));
+    }
+
+    free_board(b1);
+    free_board(b2);
+}
+
 static void assert_procedural_hashing(char* fen, Move move) {
     Board *board = from_fen(fen);
     U64 actual, expected = get_hash(board);
@@ -123,18 +431,18 @@ static void assert_procedural_hashing(char* fen, Move move) {
 
         passed = expected == get_hash(board);
     } else {
-        Move *curr = (Move[256]){0};
-        Move *end = legal_moves(board, curr);
+        ScoredMove *curr = (ScoredMove[256]){0};
+        ScoredMove *end = legal_moves(board, curr);
         if (curr == end)
             return;
 
         while (curr != end && passed) {
-            make_move(board, *curr);
-            unmake_move(board, *curr);
+            make_move(board, curr->move);
+            unmake_move(board, curr->move);
             actual = get_hash(board);
 
             if (expected != actual) {
-                move = *curr;
+                move = curr->move;
                 passed = false;
                 break;
             }
@@ -181,6 +489,9 @@ static void test_pawns() {
     assert_move("d7c6", "4k3/3p4/2B5/8/8/8/8/7K b - - 0 1", true, "pawns should be able to capture the piece that pins them");
     assert_move("f4e3", "K7/8/8/6B1/4Pp2/8/8/2k5 b - e3 0 1", true, "pinned pawns can capture ep");
     assert_move("f4g3", "K7/8/8/8/1R3p1k/6P1/8/8 b - - 0 1", false, "pinned pawns cannot capture");
+    assert_move("e2e4", "4r3/8/8/8/8/8/4P3/4K3 w - - 0 1", true, "pawns pinned along a file can double push");
+    assert_move("e2d3", "4r3/8/8/8/8/3p4/4P3/4K3 w - - 0 1", false, "pawns pinned along a file cannot capture");
+    assert_move("b7c8q", "b1r5/1P6/8/8/8/8/8/7K w - - 0 1", false, "pinned pawns cannot capture-promote off the pin");
 }
 
 static void test_sliders() {
@@ -191,6 +502,59 @@ static void test_sliders() {
     assert_move("d1d2", "4k3/8/8/8/8/2q5/8/q2QK3 w - - 0 1", false, "queen cannot leave orthoganal slider pin to block check");
 }
 
+static void test_slider_backends() {
+    printf("Testing slider attack backends...\n");
+    static U64 expected[NUM_SQUARES][64][2];
+    U64 occupancy;
+    bool passed = true;
+    int backend = best_slider_backend();
+    int sq, i;
+
+    if (backend == SLIDER_MAGIC) {
+        printf("Skipping pext backend, not supported by this CPU\n");
+        return;
+    }
+
+    set_slider_backend(SLIDER_MAGIC);
+    psrng_u64_seed(0ULL);
+    for (sq = 0; sq < NUM_SQUARES; sq++) {
+        for (i = 0; i < 64; i++) {
+            occupancy = psrng_u64() & psrng_u64();
+            expected[sq][i][0] = r_moves(1ULL << sq, occupancy);
+            expected[sq][i][1] = b_moves(1ULL << sq, occupancy);
+        }
+    }
+
+    set_slider_backend(backend);
+    psrng_u64_seed(0ULL);
+    TESTS_RUN++;
+    for (sq = 0; sq < NUM_SQUARES; sq++) {
+        for (i = 0; i < 64; i++) {
+            occupancy = psrng_u64() & psrng_u64();
+            passed = passed && expected[sq][i][0] == r_moves(1ULL << sq, occupancy);
+            passed = passed && expected[sq][i][1] == b_moves(1ULL << sq, occupancy);
+        }
+    }
+
+    if (passed) {
+        TESTS_PASSED++;
+    } else {
+        printf("SLIDER BACKEND ASSERTION FAILED\nBACKEND   %s\n", slider_backend_name());
+    }
+}
+
+static void test_staged_moves() {
+    printf("Testing staged move generation...\n");
+
+    assert_staged_moves("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+    assert_staged_moves("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+    assert_staged_moves("r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1");
+    assert_staged_moves("8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1");
+    assert_staged_moves("r6r/1b2k1bq/8/8/7B/8/8/R3K2R b KQ - 3 2");
+    assert_staged_moves("2kr3r/p1ppqpb1/bn2Qnp1/3PN3/1p2P3/2N5/PPPBBPPP/R3K2R b KQ - 3 2");
+    assert_staged_moves("b1r5/1P6/8/8/8/8/8/7K w - - 0 1");
+}
+
 static void test_perfts() {
     clock_t start = clock(), end;
     double duration;
@@ -276,13 +640,15 @@ static void test_state_stack() {
     for (i = 0; i < total_tests; i++) {
         Board* board = from_fen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
         Move random = random_move(board);
-        for (j = 0; j < (2<<16) && random != 0; j++) {
+        // games are played out until the state stack is full
+        for (j = 0; j < STACK_CAPACITY - 1 && random != 0; j++) {
             //printf("%d\n", i);
             make_move(board, random);
             random = random_move(board);
         }
-        if (j == (2<<16))
+        if (j == STACK_CAPACITY - 1)
             num_kk++;
+        free_board(board);
     }
 
     printf("Random matches had a %.1lf%% rate of being a king-king endamge (n=%d)\n", ((double)num_kk) / ((double)total_tests)*100, total_tests);
@@ -299,6 +665,167 @@ static void test_procedural_hashing() {
     assert_unequal_hashes("rnbqkbnr/p1pppppp/8/8/p1P5/8/1P1PPPPP/RNBQKBNR b KQkq - 0 3", "rnbqkbnr/p1pppppp/8/8/p1p5/8/1P1PPPPP/RNBQKBNR b KQkq - 0 1");
 }
 
+static void test_incremental_eval() {
+    printf("Cross-checking incremental evaluation...\n");
+
+    assert_incremental_psq("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 16);
+    assert_incremental_psq("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 16); // castling
+    assert_incremental_psq("r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 16); // promotions
+    assert_incremental_psq("rnbqkbnr/ppp1p1pp/8/3pPp2/8/8/PPPP1PPP/RNBQKBNR w KQkq f6 0 3", 16); // en passant
+}
+
+static void test_pawn_eval() {
+    printf("Testing pawn structure...\n");
+
+    assert_pawn_eval("4k3/8/8/8/8/8/PPPPPPPP/4K3 w - - 0 1", "4k3/pppppppp/8/8/8/8/8/4K3 b - - 0 1", 1); // all passed
+    assert_pawn_eval("4k3/pppppppp/8/8/8/8/PPPPPPPP/4K3 w - - 0 1", "4k3/pppppppp/8/8/8/8/PPPPPPPP/4K3 b - - 0 1", 0);
+    assert_pawn_eval("4k3/p1p5/8/4P3/8/8/P1P5/4K3 w - - 0 1", "4k3/p1p5/8/8/4p3/8/P1P5/4K3 b - - 0 1", 1); // passed e-pawn
+    assert_pawn_eval("4k3/ppp5/8/8/8/P7/P1P5/4K3 w - - 0 1", "4k3/p1p5/p7/8/8/8/PPP5/4K3 b - - 0 1", -1); // doubled, isolated
+}
+
+static void test_endgames() {
+    printf("Testing endgame evaluators...\n");
+
+    assert_endgame("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", ENDGAME_NONE);
+    assert_endgame("1k6/7R/2K5/8/8/8/8/8 b - - 2 2", ENDGAME_KXK);
+    assert_endgame("8/8/3k4/8/8/8/2q5/K7 w - - 0 1", ENDGAME_KXK);
+    assert_endgame("8/8/3k4/8/8/8/2NB4/K7 w - - 0 1", ENDGAME_KBNK);
+    assert_endgame("8/8/3k4/8/8/8/2N5/K7 w - - 0 1", ENDGAME_DRAW);
+    assert_endgame("8/8/3k4/8/8/8/2NN4/K7 w - - 0 1", ENDGAME_DRAW);
+    assert_endgame("8/8/3k4/8/8/8/8/K7 w - - 0 1", ENDGAME_DRAW);
+    assert_endgame("8/5p2/3k1b2/8/8/2B5/2P5/K7 w - - 0 1", ENDGAME_OCB);
+    assert_endgame("8/8/3k4/8/8/8/2PB4/K7 w - - 0 1", ENDGAME_NONE);
+    assert_endgame("8/8/3k4/8/8/8/2P5/K7 w - - 0 1", ENDGAME_KPK);
+
+    assert_kpk("8/8/8/8/8/8/4P3/4K2k w - - 0 1", true); // outside the square
+    assert_kpk("8/8/8/8/8/8/4P3/4K2k b - - 0 1", true);
+    assert_kpk("4k3/8/4K3/4P3/8/8/8/8 b - - 0 1", true); // king on the 6th
+    assert_kpk("k7/8/8/8/8/8/P7/K7 w - - 0 1", false); // rook pawn, king in the corner
+    assert_kpk("7k/8/8/8/8/8/7P/7K b - - 0 1", false);
+    assert_kpk("4k3/4P3/4K3/8/8/8/8/8 b - - 0 1", false); // stalemate
+    assert_kpk("7K/8/8/8/8/8/p7/k7 b - - 0 1", true); // black pawn
+
+    assert_eval_order("k7/8/2K5/8/8/8/8/7R w - - 0 1", "8/8/3k4/8/8/8/8/K6R w - - 0 1"); // edge & close kings
+    assert_eval_order("7k/8/5K2/8/8/8/8/3NB3 w - - 0 1", "k7/8/2K5/8/8/8/8/3NB3 w - - 0 1"); // dark bishop, h8 corner
+    assert_eval_order("8/8/3k4/8/8/8/8/K6R w - - 0 1", "8/8/3k4/8/8/8/8/K6B w - - 0 1");
+}
+
+static void test_nnue() {
+    printf("Testing NNUE accumulators...\n");
+
+    nnue_init_random(0x9e3779b97f4a7c15ULL);
+    assert_incremental_nnue("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 8);
+    assert_incremental_nnue("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 8); // castling
+    assert_incremental_nnue("r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 8); // promotions
+    assert_incremental_nnue("rnbqkbnr/ppp1p1pp/8/3pPp2/8/8/PPPP1PPP/RNBQKBNR w KQkq f6 0 3", 8); // en passant
+    nnue_unload();
+}
+
+// A KRvK table storing a single value per side to move, white wins when to
+// move & black loses, exercises everything but the Huffman decoding.
+static void test_tablebases() {
+    static const unsigned char KRVK[64] = {
+        0x71, 0xe8, 0x23, 0x5d, // WDL magic
+        0x01,                   // split by side to move, no pawns
+        0x00, 0x66, 0x44, 0xee, // group order, pieces of both sides
+        0x00,                   // alignment
+        0x80, 0x04, 0x80, 0x00, // single values, win & loss
+    };
+    static const Sq triangle[] = { 0, 1, 2, 3, 9, 10, 11, 18, 19, 27 };
+    char dir[] = "/tmp/menziesii_tbXXXXXX", path[64], fen[96];
+    Sq pawn_squares[20], psq, wk, bk;
+    FILE *file;
+    int black, i, tables, wdl, expected;
+    bool passed;
+
+    printf("Testing tablebase probing...\n");
+
+    if (mkdtemp(dir) == NULL)
+        return;
+    snprintf(path, sizeof(path), "%s/KRvK.rtbw", dir);
+    file = fopen(path, "wb");
+    fwrite(KRVK, 1, 16, file);
+    fclose(file);
+
+    tb_init(dir);
+    tables = tb_num_tables();
+    TESTS_RUN++;
+    if (tables == 1 && TB_LARGEST == 3) {
+        TESTS_PASSED++;
+    } else {
+        printf("TABLEBASE ASSERTION FAILED\nEXPECTED  1 table of 3 pieces\nACTUAL    %d tables of %d pieces\n", tables, TB_LARGEST);
+    }
+
+    assert_wdl("8/8/8/3k4/8/8/8/K6R w - - 0 1", TB_WIN);
+    assert_wdl("8/8/8/3k4/8/8/8/K6R b - - 0 1", TB_LOSS);
+    assert_wdl("r6k/8/8/8/3K4/8/8/8 b - - 0 1", TB_WIN); // black holds the rook
+    assert_wdl("8/8/8/8/8/8/6Rk/K7 b - - 0 1", TB_DRAW); // the rook hangs
+    assert_wdl("8/8/8/8/8/8/8/K6k w - - 0 1", TB_DRAW);
+
+    tb_free();
+    remove(path);
+    rmdir(dir);
+
+    // Huffman coded tables written by tests/syzygy/make_fixtures.py, KRvK
+    // keeps black to move in its DTZ table & KPvK white to move
+    tb_init("tests/syzygy");
+    tables = tb_num_tables();
+    TESTS_RUN++;
+    if (tables == 2) {
+        TESTS_PASSED++;
+    } else {
+        printf("TABLEBASE ASSERTION FAILED\nEXPECTED  2 tables in tests/syzygy\nACTUAL    %d tables\n", tables);
+        tb_free();
+        return;
+    }
+
+    assert_dtz("k7/8/1K6/8/8/8/8/7R w - - 0 1", 1); // mates in one
+    assert_dtz("k6R/8/1K6/8/8/8/8/8 b - - 0 1", -1); // mated
+    assert_dtz("k7/8/1K6/8/8/8/8/7R b - - 0 1", -2);
+    assert_dtz("4k3/8/8/8/8/8/8/4K2R w - - 0 1", 21);
+    assert_dtz("4k3/8/8/8/8/8/8/4K2R b - - 0 1", -28);
+    assert_dtz("K7/8/1k6/8/8/8/8/7r b - - 0 1", 1); // black holds the rook
+    assert_dtz("2k5/8/2K5/2P5/8/8/8/8 w - - 0 1", 3);
+    assert_dtz("2k5/8/2K5/2P5/8/8/8/8 b - - 0 1", -4);
+    assert_dtz("8/8/8/8/2p5/2k5/8/2K5 b - - 0 1", 3); // black holds the pawn
+    assert_dtz("8/8/8/8/8/8/P7/1K5k w - - 0 1", 1); // the pawn move zeroes
+    assert_dtz("8/8/4k3/8/4P3/4K3/8/8 w - - 0 1", 0);
+
+    // every pawn square of KPvK against the bitbase
+    passed = true;
+    for (black = false; black <= true; black++) {
+        for (psq = 8; psq < 56; psq++) {
+            for (wk = 0; wk < NUM_SQUARES; wk++) {
+                for (bk = 0; bk < NUM_SQUARES; bk++) {
+                    if (wk == psq || bk == psq || wk == bk || (k_moves(1ULL << wk) & (1ULL << bk))
+                            || (!black && (nort_one(east_one(1ULL << psq) | west_one(1ULL << psq)) & (1ULL << bk))))
+                        continue;
+
+                    three_piece_fen(fen, wk, 'P', psq, bk, black);
+                    Board *board = from_fen(fen);
+                    expected = kpk_probe(board) ? (black ? TB_LOSS : TB_WIN) : TB_DRAW;
+                    if (!tb_probe_wdl(board, &wdl) || wdl != expected) {
+                        if (passed)
+                            printf("KPVK ASSERTION FAILED\nFEN       %s\nEXPECTED  %d\nACTUAL    %d\n", fen, expected, wdl);
+                        passed = false;
+                    }
+                    free_board(board);
+                }
+            }
+        }
+    }
+    TESTS_RUN++;
+    TESTS_PASSED += passed;
+
+    // pawns on ranks 2-6, so no promotion to a missing table is searched
+    for (i = 0; i < 20; i++)
+        pawn_squares[i] = 8 + i / 4 * 8 + i % 4;
+    assert_tb_checksum('R', true, triangle, 10, 0x0e14f94549bc808aULL, 62320);
+    assert_tb_checksum('P', false, pawn_squares, 20, 0x830c44e2ed26deb2ULL, 138080);
+
+    tb_free();
+}
+
 static void test_draws() {
     printf("Testing threefold repitition...\n");
     
@@ -331,24 +858,92 @@ static void test_draws() {
     }
 }
 
+// The saved fields are a function of the 16 bits the table checks, so any
+// mix of two entries is caught on read.
+static int stress_score(U16 check) { return check % 20000 - 10000; }
+static Move stress_move(U16 check) { return check ^ 0x5a5a; }
+static U8 stress_depth(U16 check) { return check % 64; }
+
+static void* stress_tt(void* arg) {
+    U64 x = (U64)(size_t)arg * 0x9e3779b97f4a7c15ULL + 1;
+    U64 key;
+    U16 check;
+    TTEntry entry;
+    int i;
+
+    for (i = 0; i < TT_STRESS_ITERATIONS; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        // the top bits pick one of four buckets, so every thread fights over
+        // the same few cache lines
+        check = x % 256;
+        key = (x >> 62) << 62 | check;
+
+        if (x & 0x100) {
+            tt_save(key, stress_depth(check), stress_score(check), stress_move(check), EXACT_NODE);
+        } else if (tt_probe(key, &entry)) {
+            if (entry.score != stress_score(check) || entry.best != stress_move(check)
+                    || entry.depth != stress_depth(check) || entry.type != EXACT_NODE)
+                __atomic_fetch_add(&TT_CORRUPTED_READS, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+static void test_shared_tt() {
+    pthread_t threads[TT_STRESS_THREADS];
+    size_t i;
+
+    printf("Stress-testing shared transposition table...\n");
+    TESTS_RUN++;
+    TT_CORRUPTED_READS = 0;
+    tt_set_size(1);
+
+    for (i = 0; i < TT_STRESS_THREADS; i++)
+        pthread_create(&threads[i], NULL, stress_tt, (void*)i);
+    for (i = 0; i < TT_STRESS_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    if (TT_CORRUPTED_READS) {
+        printf("SHARED TT ASSERTION FAILED\nCORRUPTED %d\n", TT_CORRUPTED_READS);
+    } else {
+        TESTS_PASSED++;
+    }
+
+    tt_set_size(512);
+}
 
 int main(void) {
     srand(time(NULL));
     setbuf(stdout, NULL);
     init_move_lookup_tables();
+    printf("Using %s slider attacks\n", slider_backend_name());
+    init_kpk();
     init_zobrist();
+    init_psq();
     tt_set_size(512);
     TESTS_RUN = 0;
     TESTS_PASSED = 0;
 
     test_pawns();
     test_sliders();
+    test_slider_backends();
+    test_staged_moves();
     test_perfts();
     test_eval();
     test_mates();
     test_state_stack();
     test_procedural_hashing();
+    test_incremental_eval();
+    test_pawn_eval();
+    test_endgames();
+    test_nnue();
+    test_tablebases();
     test_draws();
+    test_shared_tt();
 
     if (TESTS_RUN == TESTS_PASSED) {
         printf("\nAll tests passed.\n");